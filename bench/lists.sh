@@ -0,0 +1,34 @@
+#!/bin/bash
+# Time cmarkpdf on ordered lists of 10k and 100k items.  Numbering
+# items is linear in the length of the list, so the larger list should
+# take about ten times as long; fail if it takes more than MAX_RATIO
+# times as long.
+set -e
+
+CMARKPDF=${CMARKPDF:-./cmarkpdf}
+MAX_RATIO=${MAX_RATIO:-20}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+seconds() {
+	local TIMEFORMAT=%R
+	{ time "$CMARKPDF" -o "$dir/out.pdf" "$1" >/dev/null; } 2>&1
+}
+
+for n in 10000 100000; do
+	awk -v n=$n 'BEGIN {
+		for (i = 1; i <= n; i++)
+			printf "1. changelog entry %d\n\n", i
+	}' > "$dir/list$n.md"
+done
+
+small=$(seconds "$dir/list10000.md")
+large=$(seconds "$dir/list100000.md")
+echo "10000 items: ${small}s"
+echo "100000 items: ${large}s"
+awk -v small="$small" -v large="$large" -v max="$MAX_RATIO" 'BEGIN {
+	if (small < 0.01) small = 0.01
+	ratio = large / small
+	printf "ratio: %.1f (at most %d)\n", ratio, max
+	exit ratio > max
+}'
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Time cmarkpdf on a document of 20k paragraphs laid out on one thread
+# and on JOBS threads (by default, one per processor), and check that
+# the PDFs are the same.  Fail if the speedup is less than MIN_SPEEDUP,
+# which is 0 unless set, as it depends on the machine.
+set -e
+
+CMARKPDF=${CMARKPDF:-./cmarkpdf}
+JOBS=${JOBS:-$(getconf _NPROCESSORS_ONLN)}
+MIN_SPEEDUP=${MIN_SPEEDUP:-0}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+seconds() {
+	local TIMEFORMAT=%R
+	{ time "$CMARKPDF" --jobs "$1" -o "$dir/out$1.pdf" "$dir/doc.md" \
+		>/dev/null; } 2>&1
+}
+
+awk 'BEGIN {
+	for (i = 1; i <= 20000; i++) {
+		if (i % 50 == 1)
+			printf "## Section %d\n\n", i / 50 + 1
+		printf "Paragraph %d has *emphasis*, **strong text**, `code`", i
+		printf " and words enough to fill a few lines, so that"
+		printf " breaking them takes about as long as in prose.\n\n"
+	}
+}' > "$dir/doc.md"
+
+serial=$(seconds 1)
+parallel=$(seconds "$JOBS")
+echo "1 thread: ${serial}s"
+echo "$JOBS threads: ${parallel}s"
+cmp "$dir/out1.pdf" "$dir/out$JOBS.pdf"
+awk -v serial="$serial" -v parallel="$parallel" -v min="$MIN_SPEEDUP" 'BEGIN {
+	if (parallel < 0.01) parallel = 0.01
+	speedup = serial / parallel
+	printf "speedup: %.2f (at least %s)\n", speedup, min
+	exit speedup < min
+}'
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Render alltests.md plainly, sharded, and deflated at level 6, check
+# each PDF with qpdf, and compare their page counts.  Deflating must
+# not change the pages.  Each section of a sharded render starts on a
+# new page, so it has at least as many pages as the plain render, and
+# at most one more for each level-1 heading.
+set -e
+
+CMARKPDF=${CMARKPDF:-./cmarkpdf}
+INPUT=${INPUT:-alltests.md}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+pages() {
+	qpdf --check "$1" >/dev/null || exit 1
+	qpdf --show-npages "$1"
+}
+
+"$CMARKPDF" -o "$dir/plain.pdf" "$INPUT"
+"$CMARKPDF" --shard --jobs 4 -o "$dir/shard.pdf" "$INPUT"
+"$CMARKPDF" --compression 6 --jobs 4 -o "$dir/deflate.pdf" "$INPUT"
+plain=$(pages "$dir/plain.pdf")
+shard=$(pages "$dir/shard.pdf")
+deflate=$(pages "$dir/deflate.pdf")
+# lines that may be level-1 headings, which is enough for a bound
+headings=$(grep -c '^ \{0,3\}\(#\([ \t].*\)\?\|=\+[ \t]*\)$' "$INPUT" || true)
+echo "plain: $plain pages, sharded: $shard, deflated: $deflate"
+test "$deflate" -eq "$plain"
+test "$shard" -ge "$plain" -a "$shard" -le $((plain + headings))
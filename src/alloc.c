@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "alloc.h"
+
+// Everything handed out is aligned to this, which is also the size of
+// the header in front of a counted allocation.
+#define ALIGNMENT 16
+
+#define ALIGN(n) (((n) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+// Arena blocks are this large, except for requests of more than half
+// of it, which get a block of their own.
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct arena_block {
+	struct arena_block * next;
+	size_t size;  // of the memory after the header
+	size_t used;
+};
+
+#define BLOCK_HEADER ALIGN(sizeof(struct arena_block))
+
+static __thread struct pdf_allocator * current;
+
+static void
+count_alloc(cmark_pdf_alloc_stats *stats, size_t size)
+{
+	stats->allocations++;
+	stats->bytes += size;
+	if (stats->bytes > stats->peak_bytes) {
+		stats->peak_bytes = stats->bytes;
+	}
+}
+
+// Memory is only given back when the whole arena is.
+static void * HPDF_STDCALL
+arena_alloc(HPDF_UINT size)
+{
+	struct pdf_allocator * alloc = current;
+	struct arena_block * block;
+	size_t len = ALIGN(size);
+	size_t block_size;
+	void * p;
+
+	if (alloc == NULL) {
+		return NULL;
+	}
+	block = alloc->blocks;
+	if (block == NULL || block->size - block->used < len) {
+		block_size = len > ARENA_BLOCK_SIZE / 2 ?
+			len : ARENA_BLOCK_SIZE;
+		block = (struct arena_block*)malloc(BLOCK_HEADER +
+						    block_size);
+		if (block == NULL) {
+			return NULL;
+		}
+		block->size = block_size;
+		block->used = 0;
+		// a block of its own goes behind the one being filled
+		if (block_size == len && alloc->blocks) {
+			block->next = alloc->blocks->next;
+			alloc->blocks->next = block;
+		} else {
+			block->next = alloc->blocks;
+			alloc->blocks = block;
+		}
+		alloc->stats.reserved += block_size;
+	}
+	p = (char*)block + BLOCK_HEADER + block->used;
+	block->used += len;
+	count_alloc(&alloc->stats, len);
+	return p;
+}
+
+static void HPDF_STDCALL
+arena_free(void *p)
+{
+	if (current && p) {
+		current->stats.frees++;
+	}
+}
+
+static void * HPDF_STDCALL
+counting_alloc(HPDF_UINT size)
+{
+	char * p = (char*)malloc(ALIGNMENT + size);
+
+	if (p == NULL) {
+		return NULL;
+	}
+	*(size_t*)p = size;
+	if (current) {
+		count_alloc(&current->stats, size);
+	}
+	return p + ALIGNMENT;
+}
+
+static void HPDF_STDCALL
+counting_free(void *p)
+{
+	size_t size;
+
+	if (p == NULL) {
+		return;
+	}
+	p = (char*)p - ALIGNMENT;
+	size = *(size_t*)p;
+	if (current) {
+		current->stats.frees++;
+		current->stats.bytes -= size;
+	}
+	free(p);
+}
+
+HPDF_Doc pdf_allocator_new_doc(struct pdf_allocator *alloc,
+			       HPDF_Error_Handler handler)
+{
+	switch (alloc->kind) {
+	case CMARK_PDF_ALLOC_ARENA:
+		return HPDF_NewEx(handler, arena_alloc, arena_free, 0, NULL);
+	case CMARK_PDF_ALLOC_COUNTING:
+		return HPDF_NewEx(handler, counting_alloc, counting_free, 0,
+				  NULL);
+	default:
+		return HPDF_New(handler, NULL);
+	}
+}
+
+void pdf_allocator_release(struct pdf_allocator *alloc)
+{
+	struct arena_block * block;
+
+	while ((block = alloc->blocks)) {
+		alloc->blocks = block->next;
+		free(block);
+	}
+	if (alloc->kind == CMARK_PDF_ALLOC_ARENA) {
+		alloc->stats.bytes = 0;
+		alloc->stats.reserved = 0;
+	}
+}
+
+struct pdf_allocator *pdf_allocator_enter(struct pdf_allocator *alloc)
+{
+	struct pdf_allocator * previous = current;
+
+	current = alloc;
+	return previous;
+}
+
+void pdf_allocator_leave(struct pdf_allocator *previous)
+{
+	current = previous;
+}
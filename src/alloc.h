@@ -0,0 +1,34 @@
+#ifndef CMARK_PDF_ALLOC_H
+#define CMARK_PDF_ALLOC_H
+
+#include <stddef.h>
+#include "hpdf.h"
+#include "pdf.h"
+
+struct arena_block;
+
+// Where the memory of one libharu document comes from.  libharu gives
+// its allocation functions no user data, so they find the allocator
+// through a thread-local pointer, which pdf_allocator_enter sets
+// around every use of the document.
+struct pdf_allocator {
+	int kind;  // CMARK_PDF_ALLOC_*
+	struct arena_block * blocks;
+	cmark_pdf_alloc_stats stats;
+};
+
+// Create a document using alloc, which must be entered.
+HPDF_Doc pdf_allocator_new_doc(struct pdf_allocator *alloc,
+			       HPDF_Error_Handler handler);
+
+// Give back the memory of an arena once its document has been freed
+// with HPDF_Free.
+void pdf_allocator_release(struct pdf_allocator *alloc);
+
+// Make alloc the one libharu uses on this thread, until
+// pdf_allocator_leave is passed the allocator returned.
+struct pdf_allocator *pdf_allocator_enter(struct pdf_allocator *alloc);
+
+void pdf_allocator_leave(struct pdf_allocator *previous);
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <cmark.h>
+#include "batch.h"
+#include "cache.h"
+#include "input.h"
+
+struct batch {
+	const struct batch_job * jobs;
+	size_t count;
+	int options;
+	const cmark_pdf_config * config;
+	const char * cache_dir;
+	size_t next;     // next job to claim
+	long failed;
+};
+
+struct batch_worker {
+	struct batch * batch;
+	cmark_pdf_renderer * renderer;
+	pthread_t thread;
+};
+
+// Read all of fp, or return NULL.
+static char *
+read_all(FILE *fp, size_t *len)
+{
+	char * data = NULL;
+	char * p;
+	size_t size = 0;
+	size_t n;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 16 * 1024;
+			p = (char*)realloc(data, size);
+			if (p == NULL) {
+				free(data);
+				return NULL;
+			}
+			data = p;
+		}
+		n = fread(data + *len, 1, size - *len, fp);
+		*len += n;
+	} while (n > 0);
+
+	if (ferror(fp)) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+int read_manifest(const char *path, struct batch_job **jobs,
+		  size_t *count, char **storage)
+{
+	FILE * fp;
+	char * data;
+	char * line;
+	char * end;
+	char * tab;
+	struct batch_job * p;
+	size_t len;
+	size_t size = 0;
+
+	fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error opening file %s: %s\n",
+			path, strerror(errno));
+		return 0;
+	}
+	data = read_all(fp, &len);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	if (data == NULL) {
+		fprintf(stderr, "Error reading file %s\n", path);
+		return 0;
+	}
+
+	*jobs = NULL;
+	*count = 0;
+	*storage = data;
+	line = data;
+	while (line < data + len) {
+		end = memchr(line, '\n', data + len - line);
+		if (end == NULL) {
+			// the buffer always has room for this
+			end = data + len;
+		}
+		*end = '\0';
+		if (end > line && end[-1] == '\r') {
+			end[-1] = '\0';
+		}
+		if (*line != '\0') {
+			tab = strchr(line, '\t');
+			if (tab == NULL || tab == line || tab[1] == '\0') {
+				fprintf(stderr, "%s: expected INPUT<tab>OUTPUT, "
+					"got '%s'\n", path, line);
+				goto fail;
+			}
+			*tab = '\0';
+			if (*count == size) {
+				size = size ? size * 2 : 64;
+				p = (struct batch_job*)realloc(*jobs,
+						size * sizeof(**jobs));
+				if (p == NULL) {
+					goto fail;
+				}
+				*jobs = p;
+			}
+			(*jobs)[*count].input = line;
+			(*jobs)[*count].output = tab + 1;
+			(*count)++;
+		}
+		line = end + 1;
+	}
+	return 1;
+
+fail:
+	free(*jobs);
+	free(data);
+	*jobs = NULL;
+	*storage = NULL;
+	return 0;
+}
+
+static int
+write_file(const unsigned char *data, size_t len, void *userdata)
+{
+	return fwrite(data, 1, len, (FILE *)userdata) == len;
+}
+
+static int
+render_job(cmark_pdf_renderer *renderer, const struct batch *batch,
+	   const struct batch_job *job)
+{
+	FILE * fp;
+	struct input input;
+	cmark_node * document;
+	char key[OUTPUT_CACHE_KEY_SIZE];
+	bool keyed;
+	unsigned char * pdf;
+	size_t pdf_len;
+	int fetched;
+	int ok;
+
+	if (!input_open(job->input, &input)) {
+		fprintf(stderr, "Error reading file %s: %s\n",
+			job->input, strerror(errno));
+		return 0;
+	}
+	keyed = batch->cache_dir &&
+		output_cache_key(input.data, input.len, batch->options,
+				 batch->config, key);
+	fetched = keyed ? output_cache_fetch(batch->cache_dir, key,
+					     job->output) : 0;
+	if (fetched != 0) {
+		input_close(&input);
+		if (fetched < 0) {
+			fprintf(stderr, "Error writing file %s\n",
+				job->output);
+		}
+		return fetched > 0;
+	}
+	document = cmark_parse_document(input.data, input.len,
+					batch->options);
+	input_close(&input);
+
+	fp = fopen(job->output, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Error opening file %s: %s\n",
+			job->output, strerror(errno));
+		cmark_node_free(document);
+		return 0;
+	}
+	if (keyed) {
+		ok = cmark_pdf_render_to_buffer(renderer, document,
+						&pdf, &pdf_len);
+		if (ok) {
+			ok = write_file(pdf, pdf_len, fp);
+			if (ok) {
+				output_cache_store(batch->cache_dir, key,
+						   pdf, pdf_len);
+			}
+			free(pdf);
+		}
+	} else {
+		ok = cmark_pdf_render(renderer, document, write_file, fp);
+	}
+	if (fclose(fp) != 0) {
+		ok = 0;
+	}
+	cmark_node_free(document);
+	if (!ok) {
+		fprintf(stderr, "Could not render %s\n", job->input);
+	}
+	return ok;
+}
+
+// Jobs are independent and claimed one at a time, so a worker that
+// gets small files simply claims more of them.
+static void *
+run_worker(void *arg)
+{
+	struct batch_worker * worker = (struct batch_worker*)arg;
+	struct batch * batch = worker->batch;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&batch->next, 1,
+				       __ATOMIC_RELAXED)) < batch->count) {
+		if (!render_job(worker->renderer, batch,
+				&batch->jobs[i])) {
+			__atomic_add_fetch(&batch->failed, 1,
+					   __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+long render_batch(const struct batch_job *jobs, size_t count,
+		  int options, const cmark_pdf_config *config, int threads,
+		  const char *cache_dir)
+{
+	struct batch batch = { jobs, count, options, config, cache_dir,
+			       0, 0 };
+	struct batch_worker * workers;
+	int started = 0;
+	int i;
+
+	if (threads < 1) {
+		threads = 1;
+	}
+	if ((size_t)threads > count) {
+		threads = count ? count : 1;
+	}
+	workers = (struct batch_worker*)calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		return -1;
+	}
+
+	// each thread renders into its own libharu document, so each
+	// needs its own renderer with its own copy of the fonts
+	for (i = 0; i < threads; i++) {
+		workers[i].batch = &batch;
+		workers[i].renderer = cmark_pdf_renderer_new(options, config);
+		if (workers[i].renderer == NULL) {
+			break;
+		}
+	}
+	threads = i;
+	if (threads == 0) {
+		free(workers);
+		return -1;
+	}
+
+	// the calling thread is the first worker
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	run_worker(&workers[0]);
+	for (i = 1; i <= started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (i = 0; i < threads; i++) {
+		cmark_pdf_renderer_free(workers[i].renderer);
+	}
+	free(workers);
+	return batch.failed;
+}
@@ -0,0 +1,27 @@
+#ifndef CMARK_PDF_BATCH_H
+#define CMARK_PDF_BATCH_H
+
+#include <stddef.h>
+#include "pdf.h"
+
+struct batch_job {
+	const char * input;
+	const char * output;
+};
+
+// Read a manifest with one job per line: the input path, a tab and
+// the output path.  Blank lines are skipped.  The paths point into
+// *storage, which the caller frees along with *jobs.  Returns 1 on
+// success, 0 on failure.
+int read_manifest(const char *path, struct batch_job **jobs,
+		  size_t *count, char **storage);
+
+// Render each job's input to its output on up to threads threads,
+// each with its own renderer.  If cache_dir is not NULL, PDFs are
+// reused from it and added to it.  Returns the number of jobs that
+// failed, or -1 if no renderer could be created.
+long render_batch(const struct batch_job *jobs, size_t count,
+		  int options, const cmark_pdf_config *config, int threads,
+		  const char *cache_dir);
+
+#endif
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cmark.h>
+#include "cache.h"
+#include "sha256.h"
+
+// Change this whenever a change to the renderer changes its output.
+#define RENDERER_VERSION "cmarkpdf 1"
+
+// Everything is hashed with SHA-256, since a collision would hand
+// out the wrong PDF.  Each part of the key is either of fixed size or
+// self-delimiting, so that no two different inputs hash the same
+// bytes.
+
+static void
+hash_string(struct sha256 *h, const char *s)
+{
+	// include the terminator so that "ab","c" differs from "a","bc"
+	sha256_update(h, s, strlen(s) + 1);
+}
+
+// Hash the name and the digest of the content of a file.  A missing
+// file hashes differently from any content.
+static void
+hash_file(struct sha256 *h, const char *path)
+{
+	unsigned char buffer[64 * 1024];
+	unsigned char digest[SHA256_SIZE];
+	struct sha256 content;
+	FILE * fp;
+	size_t n;
+
+	hash_string(h, path);
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		hash_string(h, "missing");
+		return;
+	}
+	sha256_init(&content);
+	while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		sha256_update(&content, buffer, n);
+	}
+	if (ferror(fp)) {
+		hash_string(h, "unreadable");
+	} else {
+		hash_string(h, "content");
+		sha256_final(&content, digest);
+		sha256_update(h, digest, sizeof(digest));
+	}
+	fclose(fp);
+}
+
+static unsigned char font_hash[SHA256_SIZE];
+static pthread_once_t font_hash_once = PTHREAD_ONCE_INIT;
+
+static void
+hash_fonts(void)
+{
+	const char * paths[8];
+	struct sha256 h;
+	int i;
+
+	sha256_init(&h);
+	cmark_pdf_font_paths(paths);
+	for (i = 0; i < 8; i++) {
+		hash_file(&h, paths[i]);
+	}
+	sha256_final(&h, font_hash);
+}
+
+// Every image starts with "![", so the text only needs to be parsed
+// to find images if it has one.
+static void
+hash_images(struct sha256 *h, const char *text, size_t len, int options)
+{
+	const char * p = text;
+	const char * end = text + len;
+	cmark_node * document;
+	cmark_iter * iter;
+	cmark_event_type ev_type;
+	cmark_node * cur;
+
+	if (len < 2) {
+		return;
+	}
+	while ((p = memchr(p, '!', end - p)) != NULL &&
+	       p + 1 < end && p[1] != '[') {
+		p++;
+	}
+	if (p == NULL || p + 1 >= end) {
+		return;
+	}
+	document = cmark_parse_document(text, len, options);
+	iter = cmark_iter_new(document);
+	while ((ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+		cur = cmark_iter_get_node(iter);
+		if (ev_type == CMARK_EVENT_ENTER &&
+		    cmark_node_get_type(cur) == CMARK_NODE_IMAGE) {
+			hash_file(h, cmark_node_get_url(cur));
+		}
+	}
+	cmark_iter_free(iter);
+	cmark_node_free(document);
+}
+
+int output_cache_key(const char *text, size_t len, int options,
+		     const cmark_pdf_config *config, char *key)
+{
+	struct sha256 h;
+	unsigned char digest[SHA256_SIZE];
+	int i;
+
+	if (pthread_once(&font_hash_once, hash_fonts) != 0) {
+		return 0;
+	}
+	sha256_init(&h);
+	hash_string(&h, RENDERER_VERSION);
+	hash_string(&h, CMARK_VERSION_STRING);
+	sha256_update(&h, font_hash, sizeof(font_hash));
+	sha256_update(&h, &options, sizeof(options));
+	sha256_update(&h, &config->image_dpi, sizeof(config->image_dpi));
+	sha256_update(&h, &config->compression_level,
+		      sizeof(config->compression_level));
+	sha256_update(&h, &len, sizeof(len));
+	sha256_update(&h, text, len);
+	hash_images(&h, text, len, options);
+	sha256_final(&h, digest);
+
+	for (i = 0; i < SHA256_SIZE; i++) {
+		snprintf(key + 2 * i, 3, "%02x", digest[i]);
+	}
+	return 1;
+}
+
+static int
+cache_path(char *path, size_t size, const char *dir, const char *key)
+{
+	return snprintf(path, size, "%s/%s.pdf", dir, key) < (int)size;
+}
+
+// Read all of the cached PDF at path, or return NULL.
+static char *
+read_cached(const char *path, size_t *len)
+{
+	FILE * fp;
+	struct stat st;
+	char * data;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size == 0) {
+		fclose(fp);
+		return NULL;
+	}
+	*len = (size_t)st.st_size;
+	data = (char*)malloc(*len);
+	if (data != NULL && fread(data, 1, *len, fp) != *len) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+int output_cache_fetch(const char *dir, const char *key,
+		       const char *outfile)
+{
+	char path[4096];
+	char * data;
+	size_t len;
+	FILE * out;
+	int ok;
+
+	if (!cache_path(path, sizeof(path), dir, key)) {
+		return 0;
+	}
+	// read first, so that a cached file that can't be read leaves
+	// the output untouched for rendering
+	data = read_cached(path, &len);
+	if (data == NULL) {
+		return 0;
+	}
+	// copied rather than linked, so that writing to the output
+	// later can't change the cached file
+	out = strcmp(outfile, "-") == 0 ? stdout : fopen(outfile, "wb");
+	if (out == NULL) {
+		free(data);
+		return -1;
+	}
+	ok = fwrite(data, 1, len, out) == len;
+	if (out == stdout ? fflush(out) != 0 : fclose(out) != 0) {
+		ok = 0;
+	}
+	free(data);
+	return ok ? 1 : -1;
+}
+
+void output_cache_store(const char *dir, const char *key,
+			const unsigned char *data, size_t len)
+{
+	char path[4096];
+	char tmp[4096];
+	FILE * fp;
+	int fd;
+	int ok;
+
+	if (!cache_path(path, sizeof(path), dir, key) ||
+	    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		return;
+	}
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+		return;
+	}
+	// written aside and renamed into place, so that a concurrent
+	// fetch never sees part of a file
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		return;
+	}
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	ok = fwrite(data, 1, len, fp) == len;
+	if (fclose(fp) != 0) {
+		ok = 0;
+	}
+	if (!ok || rename(tmp, path) != 0) {
+		unlink(tmp);
+	}
+}
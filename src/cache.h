@@ -0,0 +1,32 @@
+#ifndef CMARK_PDF_CACHE_H
+#define CMARK_PDF_CACHE_H
+
+#include <stddef.h>
+#include "pdf.h"
+#include "sha256.h"
+
+// Rendered PDFs are kept in a directory under a hash of everything
+// that goes into them: the Markdown, the options and configuration,
+// the fonts, the images it shows and the renderer version.  Rendering
+// the same input again gives the same bytes, so a cached PDF can
+// stand in for a new one.
+
+// a SHA-256 in hex
+#define OUTPUT_CACHE_KEY_SIZE (2 * SHA256_SIZE + 1)
+
+// Compute the key for rendering text.  Returns 0 on failure.
+int output_cache_key(const char *text, size_t len, int options,
+		     const cmark_pdf_config *config, char *key);
+
+// If dir holds a PDF for key, copy it to outfile ("-" for stdout) and
+// return 1.  Returns 0, having written nothing, if there is no usable
+// PDF, or -1 if the output couldn't be written; part of the PDF may
+// have been, so the caller must not write another after it.
+int output_cache_fetch(const char *dir, const char *key,
+		       const char *outfile);
+
+// Add a PDF to dir under key.  Failing to cache it is not an error.
+void output_cache_store(const char *dir, const char *key,
+			const unsigned char *data, size_t len);
+
+#endif
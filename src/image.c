@@ -0,0 +1,528 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <png.h>
+#include "image.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+#define PNG_SIGNATURE "\x89PNG\r\n\x1a\n"
+
+static uint64_t
+hash_bytes(uint64_t h, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * FNV_PRIME;
+	}
+	return h;
+}
+
+static uint64_t
+image_key(uint64_t content, unsigned int width, unsigned int height)
+{
+	unsigned char dims[8];
+
+	memcpy(dims, &width, 4);
+	memcpy(dims + 4, &height, 4);
+	return hash_bytes(content, dims, sizeof(dims));
+}
+
+// Find the slot for an entry like e, which is either empty or holds
+// a matching entry.  A file entry is matched by path alone.
+static struct image_entry *
+find_entry(struct image_cache *cache, const struct image_entry *e)
+{
+	size_t mask = cache->size - 1;
+	size_t i = e->key & mask;
+	struct image_entry * slot;
+
+	while (1) {
+		slot = &cache->entries[i];
+		if (!slot->used) {
+			return slot;
+		}
+		if (slot->key == e->key && slot->kind == e->kind &&
+		    (e->kind == IMAGE_LOADED ?
+		     memcmp(slot->content, e->content, SHA256_SIZE) == 0 :
+		     strcmp(slot->path, e->path) == 0) &&
+		    (e->kind == IMAGE_FILE ||
+		     (slot->width == e->width && slot->height == e->height))) {
+			return slot;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+static struct image_entry *
+lookup(struct image_cache *cache, const struct image_entry *e)
+{
+	struct image_entry * slot;
+
+	if (cache->size == 0) {
+		return NULL;
+	}
+	slot = find_entry(cache, e);
+	return slot->used ? slot : NULL;
+}
+
+static bool
+grow(struct image_cache *cache)
+{
+	struct image_cache old = *cache;
+	size_t i;
+
+	cache->size = old.size ? old.size * 2 : 32;
+	cache->entries = (struct image_entry*)calloc(cache->size,
+						      sizeof(*cache->entries));
+	if (cache->entries == NULL) {
+		*cache = old;
+		return false;
+	}
+	for (i = 0; i < old.size; i++) {
+		if (old.entries[i].used) {
+			*find_entry(cache, &old.entries[i]) = old.entries[i];
+		}
+	}
+	free(old.entries);
+	return true;
+}
+
+// Add a copy of e, returning it, or NULL if out of memory.  File
+// entries get their own copy of the path, which the others share.
+static struct image_entry *
+add_entry(struct image_cache *cache, const struct image_entry *e)
+{
+	struct image_entry * slot;
+
+	if ((cache->count + 1) * 4 > cache->size * 3 && !grow(cache)) {
+		return NULL;
+	}
+	slot = find_entry(cache, e);
+	*slot = *e;
+	if (e->kind == IMAGE_FILE) {
+		slot->path = strdup(e->path);
+		if (slot->path == NULL) {
+			slot->used = false;
+			return NULL;
+		}
+	}
+	slot->used = true;
+	cache->count++;
+	return slot;
+}
+
+// Read the size of a PNG from its IHDR chunk.
+static bool
+png_header(const unsigned char *data, size_t len, unsigned int *width,
+	   unsigned int *height)
+{
+	if (len < 24 || memcmp(data, PNG_SIGNATURE, 8) != 0 ||
+	    memcmp(data + 12, "IHDR", 4) != 0) {
+		return false;
+	}
+	*width = ((unsigned int)data[16] << 24) | (data[17] << 16) |
+		(data[18] << 8) | data[19];
+	*height = ((unsigned int)data[20] << 24) | (data[21] << 16) |
+		(data[22] << 8) | data[23];
+	return *width > 0 && *height > 0;
+}
+
+// Read the dimensions and number of components of a JPEG from its
+// SOF segment, without decoding anything.  Returns false unless it
+// is a JPEG that can be embedded as is: 8-bit baseline, extended or
+// progressive Huffman coding, with gray, RGB/YCbCr or CMYK color.
+static bool
+jpeg_header(const unsigned char *data, size_t len, unsigned int *width,
+	    unsigned int *height, int *components)
+{
+	size_t pos = 2;
+	size_t seglen;
+	unsigned char marker;
+
+	if (len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+		return false;
+	}
+	while (pos + 4 <= len) {
+		if (data[pos] != 0xFF) {
+			return false;
+		}
+		marker = data[pos + 1];
+		if (marker == 0xFF) {  // fill byte
+			pos++;
+			continue;
+		}
+		if (marker == 0xD8 || (marker >= 0xD0 && marker <= 0xD7) ||
+		    marker == 0x01) {  // no length
+			pos += 2;
+			continue;
+		}
+		seglen = ((size_t)data[pos + 2] << 8) | data[pos + 3];
+		if (seglen < 2 || pos + 2 + seglen > len) {
+			return false;
+		}
+		if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+			if (seglen < 8 || data[pos + 4] != 8) {
+				return false;
+			}
+			*height = (data[pos + 5] << 8) | data[pos + 6];
+			*width = (data[pos + 7] << 8) | data[pos + 8];
+			*components = data[pos + 9];
+			return *width > 0 && *height > 0 &&
+				(*components == 1 || *components == 3 ||
+				 *components == 4);
+		}
+		if ((marker >= 0xC3 && marker <= 0xCF && marker != 0xC4 &&
+		     marker != 0xC8 && marker != 0xCC) || marker == 0xDA) {
+			// lossless or arithmetic coded, or no frame
+			// header before the scan
+			return false;
+		}
+		pos += 2 + seglen;
+	}
+	return false;
+}
+
+// Read the file at path, or at least its first limit bytes if limit
+// is not 0.
+static unsigned char *
+read_file(const char *path, size_t limit, size_t *len)
+{
+	FILE * fp = fopen(path, "rb");
+	unsigned char * data = NULL;
+	unsigned char * p;
+	size_t size = 0;
+	size_t n;
+
+	if (fp == NULL) {
+		return NULL;
+	}
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : (limit ? limit : 64 * 1024);
+			p = (unsigned char*)realloc(data, size);
+			if (p == NULL) {
+				free(data);
+				fclose(fp);
+				return NULL;
+			}
+			data = p;
+		}
+		n = fread(data + *len, 1, size - *len, fp);
+		*len += n;
+	} while (n > 0 && (limit == 0 || *len < limit));
+
+	if (ferror(fp)) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+// Decode a PNG, or embed a JPEG's DCT data as it is.
+static HPDF_Image
+load_image(HPDF_Doc pdf, const unsigned char *data, size_t len,
+	   enum image_format format)
+{
+	if (format == IMAGE_PNG) {
+		return HPDF_LoadPngImageFromMem(pdf, data, len);
+	}
+	// libharu only reads the frame header and copies the stream
+	// with /DCTDecode
+	return HPDF_LoadJpegImageFromMem(pdf, data, len);
+}
+
+// Decode a PNG and shrink it to width x height pixels by averaging
+// the source pixels that fall in each target pixel.  Transparency is
+// kept as a soft mask, if one can be added.
+static HPDF_Image
+load_resampled_png(HPDF_Doc pdf, const unsigned char *data, size_t len,
+		   unsigned int width, unsigned int height)
+{
+	png_image png;
+	unsigned char * pixels = NULL;
+	unsigned char * color = NULL;
+	unsigned char * alpha = NULL;
+	uint64_t * sums = NULL;
+	HPDF_Image image = NULL;
+	HPDF_Image mask;
+	unsigned int x, y, sx, sy, sx0, sx1, sy0, sy1, c;
+	uint64_t n;
+	unsigned int channels, colors;
+	bool has_alpha;
+	const unsigned char * src;
+	uint64_t * sum;
+	uint64_t a, weight;
+
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_memory(&png, data, len)) {
+		return NULL;
+	}
+	has_alpha = (png.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+	png.format = (png.format & PNG_FORMAT_FLAG_COLOR) |
+		(has_alpha ? PNG_FORMAT_FLAG_ALPHA : 0);
+	channels = PNG_IMAGE_SAMPLE_CHANNELS(png.format);
+	colors = has_alpha ? channels - 1 : channels;
+
+	pixels = (unsigned char*)malloc(PNG_IMAGE_SIZE(png));
+	color = (unsigned char*)malloc((size_t)width * height * colors);
+	alpha = (unsigned char*)malloc((size_t)width * height);
+	// per target column: alpha-weighted color sums, alpha, count
+	sums = (uint64_t*)malloc((size_t)width * (colors + 2) *
+				 sizeof(uint64_t));
+	if (pixels == NULL || color == NULL || alpha == NULL ||
+	    sums == NULL) {
+		png_image_free(&png);
+		goto done;
+	}
+	if (!png_image_finish_read(&png, NULL, pixels, 0, NULL)) {
+		goto done;
+	}
+
+	for (y = 0; y < height; y++) {
+		sy0 = (uint64_t)y * png.height / height;
+		sy1 = (uint64_t)(y + 1) * png.height / height;
+		memset(sums, 0, (size_t)width * (colors + 2) *
+		       sizeof(uint64_t));
+		for (sy = sy0; sy < sy1; sy++) {
+			src = pixels + (size_t)sy * png.width * channels;
+			for (x = 0; x < width; x++) {
+				sx0 = (uint64_t)x * png.width / width;
+				sx1 = (uint64_t)(x + 1) * png.width / width;
+				sum = sums + (size_t)x * (colors + 2);
+				for (sx = sx0; sx < sx1; sx++) {
+					a = has_alpha ?
+						src[sx * channels + colors] : 255;
+					for (c = 0; c < colors; c++) {
+						sum[c] += a * src[sx * channels + c];
+					}
+					sum[colors] += a;
+					sum[colors + 1]++;
+				}
+			}
+		}
+		for (x = 0; x < width; x++) {
+			sum = sums + (size_t)x * (colors + 2);
+			weight = sum[colors];
+			n = sum[colors + 1];
+			for (c = 0; c < colors; c++) {
+				color[((size_t)y * width + x) * colors + c] =
+					weight ? sum[c] / weight : 0;
+			}
+			alpha[(size_t)y * width + x] = n ? weight / n : 0;
+		}
+	}
+
+	image = HPDF_LoadRawImageFromMem(pdf, color, width, height,
+					 colors == 1 ? HPDF_CS_DEVICE_GRAY :
+					 HPDF_CS_DEVICE_RGB, 8);
+	if (image != NULL && has_alpha) {
+		mask = HPDF_LoadRawImageFromMem(pdf, alpha, width, height,
+						HPDF_CS_DEVICE_GRAY, 8);
+		// the color data is in the document already, so without
+		// its mask it is drawn opaque rather than left unused
+		if (mask == NULL ||
+		    HPDF_Image_AddSMask(image, mask) != HPDF_OK) {
+			HPDF_ResetError(pdf);
+		}
+	}
+
+done:
+	free(pixels);
+	free(color);
+	free(alpha);
+	free(sums);
+	return image;
+}
+
+// Find the format and size of the image at path from the start of
+// the file, reading more only if a JPEG's frame header is further in.
+static bool
+probe_file(const char *path, struct image_entry *file)
+{
+	unsigned char * data;
+	size_t limit = 4096;
+	size_t len;
+	int components;
+	bool jpeg;
+
+	while (1) {
+		data = read_file(path, limit, &len);
+		if (data == NULL) {
+			return false;
+		}
+		if (png_header(data, len, &file->width, &file->height)) {
+			file->format = IMAGE_PNG;
+			break;
+		}
+		if (jpeg_header(data, len, &file->width, &file->height,
+				&components)) {
+			file->format = IMAGE_JPEG;
+			break;
+		}
+		jpeg = len >= 2 && data[0] == 0xFF && data[1] == 0xD8;
+		free(data);
+		if (len < limit || !jpeg) {
+			// the whole file was read, or it isn't a JPEG
+			return false;
+		}
+		limit *= 4;
+	}
+	free(data);
+	return true;
+}
+
+long
+image_cache_probe(struct image_cache *cache, const char *path,
+		  float max_width, int dpi, float *width, float *height)
+{
+	struct image_entry file = { 0 };
+	struct image_entry use = { 0 };
+	struct image_entry * found;
+	struct image_use * uses;
+	unsigned int target_width, target_height;
+	size_t size;
+
+	file.kind = IMAGE_FILE;
+	file.path = (char*)path;
+	file.key = hash_bytes(FNV_OFFSET, (const unsigned char*)path,
+			      strlen(path));
+	found = lookup(cache, &file);
+	if (found != NULL) {
+		file = *found;
+	} else {
+		if (!probe_file(path, &file)) {
+			return -1;
+		}
+		found = add_entry(cache, &file);
+		if (found == NULL) {
+			return -1;
+		}
+		file.path = found->path;
+	}
+
+	// one pixel per point, scaled down to fit the line
+	*width = file.width;
+	*height = file.height;
+	if (max_width > 0 && *width > max_width) {
+		*height *= max_width / *width;
+		*width = max_width;
+	}
+
+	// pixels needed at the target resolution
+	target_width = file.width;
+	target_height = file.height;
+	if (dpi > 0 && file.format == IMAGE_PNG &&
+	    *width * dpi / 72 < file.width) {
+		target_width = (unsigned int)(*width * dpi / 72 + 0.5);
+		target_height = (unsigned int)((double)file.height *
+					       target_width / file.width + 0.5);
+		if (target_width < 1) {
+			target_width = 1;
+		}
+		if (target_height < 1) {
+			target_height = 1;
+		}
+	}
+
+	use.kind = IMAGE_USE;
+	use.path = file.path;
+	use.width = target_width;
+	use.height = target_height;
+	use.key = image_key(file.key, target_width, target_height);
+	found = lookup(cache, &use);
+	if (found != NULL) {
+		return found->use;
+	}
+
+	if (cache->numuses == cache->usessize) {
+		size = cache->usessize ? cache->usessize * 2 : 16;
+		uses = (struct image_use*)realloc(cache->uses,
+						  size * sizeof(*uses));
+		if (uses == NULL) {
+			return -1;
+		}
+		cache->uses = uses;
+		cache->usessize = size;
+	}
+	use.use = cache->numuses++;
+	cache->uses[use.use].path = file.path;
+	cache->uses[use.use].format = file.format;
+	cache->uses[use.use].file_width = file.width;
+	cache->uses[use.use].file_height = file.height;
+	cache->uses[use.use].width = target_width;
+	cache->uses[use.use].height = target_height;
+	cache->uses[use.use].image = NULL;
+	cache->uses[use.use].failed = false;
+	add_entry(cache, &use);
+	return use.use;
+}
+
+HPDF_Image
+image_cache_image(struct image_cache *cache, HPDF_Doc pdf, long id)
+{
+	struct image_use * use = &cache->uses[id];
+	struct image_entry loaded = { 0 };
+	struct image_entry * found;
+	unsigned char * data;
+	size_t len;
+
+	if (use->image != NULL || use->failed) {
+		return use->image;
+	}
+	use->failed = true;
+
+	data = read_file(use->path, 0, &len);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	// the same image at the same size under another name
+	loaded.kind = IMAGE_LOADED;
+	sha256(data, len, loaded.content);
+	loaded.width = use->width;
+	loaded.height = use->height;
+	loaded.key = image_key(hash_bytes(FNV_OFFSET, loaded.content,
+					  SHA256_SIZE),
+			       use->width, use->height);
+	found = lookup(cache, &loaded);
+	if (found != NULL) {
+		loaded.image = found->image;
+	} else if (use->width == use->file_width &&
+		   use->height == use->file_height) {
+		loaded.image = load_image(pdf, data, len, use->format);
+	} else {
+		loaded.image = load_resampled_png(pdf, data, len,
+						  use->width, use->height);
+	}
+	free(data);
+
+	if (loaded.image != NULL) {
+		if (found == NULL) {
+			add_entry(cache, &loaded);
+		}
+		use->image = loaded.image;
+		use->failed = false;
+	}
+	return use->image;
+}
+
+void
+image_cache_free(struct image_cache *cache)
+{
+	size_t i;
+
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].kind == IMAGE_FILE) {
+			free(cache->entries[i].path);
+		}
+	}
+	free(cache->entries);
+	free(cache->uses);
+	memset(cache, 0, sizeof(*cache));
+}
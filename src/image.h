@@ -0,0 +1,79 @@
+#ifndef CMARK_PDF_IMAGE_H
+#define CMARK_PDF_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hpdf.h"
+#include "sha256.h"
+
+enum image_format {
+	IMAGE_PNG = 1,
+	IMAGE_JPEG
+};
+
+enum image_kind {
+	IMAGE_FILE = 1,
+	IMAGE_USE,
+	IMAGE_LOADED
+};
+
+// The cache holds three kinds of entries.  File entries map a path
+// to the format and size in pixels read from the file's header.  Use
+// entries map (path, pixel size) to an index into the uses array, so
+// that layout can refer to an image before it is loaded.  Loaded
+// entries map (SHA-256 of the content, pixel size) to an image in the
+// document, so that an image used many times, under any name, is
+// read, resampled and embedded once per size it is shown at.
+struct image_entry {
+	bool used;
+	enum image_kind kind;
+	uint64_t key;
+	char * path;          // file and use entries
+	unsigned char content[SHA256_SIZE];  // loaded entries
+	enum image_format format;
+	unsigned int width;   // pixels
+	unsigned int height;
+	long use;             // use entries
+	HPDF_Image image;     // loaded entries
+};
+
+struct image_use {
+	const char * path;
+	enum image_format format;
+	unsigned int file_width;   // pixels in the file
+	unsigned int file_height;
+	unsigned int width;        // pixels to embed
+	unsigned int height;
+	HPDF_Image image;
+	bool failed;
+};
+
+struct image_cache {
+	struct image_entry * entries;
+	size_t count;
+	size_t size;
+	struct image_use * uses;
+	long numuses;
+	long usessize;
+};
+
+// Looks at the header of the image (PNG or JPEG) at path, to be shown
+// at most max_width points wide, and sets *width and *height to its
+// size on the page, at 72 pixels per inch unless that is too wide.
+// If dpi is not 0, PNGs with more pixels than that resolution needs
+// will be downsampled.  Returns an id to pass to image_cache_image,
+// or -1 if the file can't be read or isn't a supported image.  Only
+// the start of the file is read.
+long image_cache_probe(struct image_cache *cache, const char *path,
+		       float max_width, int dpi, float *width,
+		       float *height);
+
+// Returns the image for an id from image_cache_probe, loading it into
+// pdf the first time, or NULL if it can't be loaded.
+HPDF_Image image_cache_image(struct image_cache *cache, HPDF_Doc pdf,
+			     long id);
+
+void image_cache_free(struct image_cache *cache);
+
+#endif
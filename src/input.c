@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "input.h"
+
+// Pipes are read this much at a time at first, and more as the buffer
+// doubles.
+#define READ_SIZE (256 * 1024)
+
+// Read fd up to the end.  Only a read of nothing is the end: a pipe
+// can return less than was asked for at any time.
+static int
+read_all(int fd, struct input *input)
+{
+	char * p;
+	size_t size = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (input->len == size) {
+			size = size ? size * 2 : READ_SIZE;
+			p = (char*)realloc(input->buffer, size);
+			if (p == NULL) {
+				return 0;
+			}
+			input->buffer = p;
+		}
+		n = read(fd, input->buffer + input->len, size - input->len);
+		if (n > 0) {
+			input->len += n;
+		} else if (n == 0) {
+			return 1;
+		} else if (errno != EINTR) {
+			return 0;
+		}
+	}
+}
+
+// Map a regular file read from its start, telling the kernel to read
+// it all in.
+static int
+map_file(int fd, struct input *input)
+{
+	struct stat st;
+	void * map;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	    lseek(fd, 0, SEEK_CUR) != 0) {
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+	madvise(map, st.st_size, MADV_WILLNEED);
+	input->map = map;
+	input->len = st.st_size;
+	return 1;
+}
+
+int input_open(const char *path, struct input *input)
+{
+	int fd;
+	int ok;
+	int saved;
+
+	memset(input, 0, sizeof(*input));
+	fd = path ? open(path, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		return 0;
+	}
+	ok = map_file(fd, input) || read_all(fd, input);
+	saved = errno;
+	if (path) {
+		close(fd);
+	}
+	if (!ok) {
+		input_close(input);
+		errno = saved;
+		return 0;
+	}
+	input->data = input->map ? (const char*)input->map :
+		input->buffer ? input->buffer : "";
+	return 1;
+}
+
+void input_close(struct input *input)
+{
+	if (input->map) {
+		munmap(input->map, input->len);
+	}
+	free(input->buffer);
+	memset(input, 0, sizeof(*input));
+}
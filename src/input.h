@@ -0,0 +1,23 @@
+#ifndef CMARK_PDF_INPUT_H
+#define CMARK_PDF_INPUT_H
+
+#include <stddef.h>
+
+// The text of one input: a regular file is mapped, anything else is
+// read into a buffer.
+struct input {
+	const char * data;
+	size_t len;
+	void * map;     // the mapping, or NULL
+	char * buffer;  // what was read, or NULL
+};
+
+// Map or read the file at path, or standard input if path is NULL.  A
+// mapped file is only read ahead in the background, so several can be
+// opened before the first is parsed.  Returns 1 on success, 0 on
+// failure with errno set.
+int input_open(const char *path, struct input *input);
+
+void input_close(struct input *input);
+
+#endif
@@ -4,23 +4,220 @@
 #include <math.h>
 #include <setjmp.h>
 #include <errno.h>
+#include <unistd.h>
 #include <cmark.h>
 #include <hpdf.h>
 #include "pdf.h"
+#include "batch.h"
+#include "serve.h"
+#include "cache.h"
+#include "shard.h"
+#include "input.h"
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <io.h>
 #include <fcntl.h>
 #endif
 
+struct buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static int append(struct buffer *buf, const char *data, size_t len)
+{
+	char *p;
+	size_t size;
+
+	if (buf->len + len > buf->size) {
+		size = buf->size ? buf->size : 64 * 1024;
+		while (size < buf->len + len) {
+			size *= 2;
+		}
+		p = (char *)realloc(buf->data, size);
+		if (p == NULL) {
+			return 0;
+		}
+		buf->data = p;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 1;
+}
+
+struct output {
+	FILE *fp;
+	struct buffer *copy;  // for the cache, or NULL
+};
+
+static int write_output(const unsigned char *data, size_t len,
+			void *userdata)
+{
+	struct output *out = (struct output *)userdata;
+
+	if (out->copy && !append(out->copy, (const char *)data, len)) {
+		return 0;
+	}
+	return fwrite(data, 1, len, out->fp) == len;
+}
+
+static int run_batch(const char *manifest, int options,
+		     const cmark_pdf_config *config, int threads,
+		     const char *cache_dir)
+{
+	struct batch_job *jobs;
+	size_t count;
+	char *storage;
+	long failed;
+
+	if (!read_manifest(manifest, &jobs, &count, &storage)) {
+		return 1;
+	}
+	failed = render_batch(jobs, count, options, config, threads,
+	                      cache_dir);
+	if (failed > 0) {
+		fprintf(stderr, "%ld of %lu documents failed\n", failed,
+		        (unsigned long)count);
+	}
+	free(jobs);
+	free(storage);
+	return failed == 0 ? 0 : 1;
+}
+
+// Parse the inputs as one document, feeding each to the parser in
+// one go.
+static cmark_node *parse_inputs(const struct input *inputs, int count,
+				int options)
+{
+	cmark_parser *parser;
+	cmark_node *document;
+	int i;
+
+	parser = cmark_parser_new(options);
+	for (i = 0; i < count; i++) {
+		cmark_parser_feed(parser, inputs[i].data, inputs[i].len);
+	}
+	document = cmark_parser_finish(parser);
+	cmark_parser_free(parser);
+	return document;
+}
+
+static const char *block_type(cmark_node *node)
+{
+	switch (cmark_node_get_type(node)) {
+	case CMARK_NODE_BLOCK_QUOTE:
+		return "block_quote";
+	case CMARK_NODE_LIST:
+		return "list";
+	case CMARK_NODE_ITEM:
+		return "item";
+	case CMARK_NODE_CODE_BLOCK:
+		return "code_block";
+	case CMARK_NODE_HTML:
+		return "html";
+	case CMARK_NODE_PARAGRAPH:
+		return "paragraph";
+	case CMARK_NODE_HEADER:
+		return "header";
+	case CMARK_NODE_HRULE:
+		return "hrule";
+	default:
+		return "unknown";
+	}
+}
+
+// Write the page count and where each top-level block starts.
+static int write_pagination(FILE *fp,
+			    const cmark_pdf_pagination *pagination)
+{
+	const cmark_pdf_block_position *block;
+	size_t i;
+
+	fprintf(fp, "{\"pages\": %d, \"blocks\": [", pagination->pages);
+	for (i = 0; i < pagination->count; i++) {
+		block = &pagination->blocks[i];
+		fprintf(fp, "%s\n  {\"type\": \"%s\", ", i ? "," : "",
+		        block_type(block->node));
+		if (cmark_node_get_type(block->node) == CMARK_NODE_HEADER) {
+			fprintf(fp, "\"level\": %d, ",
+			        cmark_node_get_header_level(block->node));
+		}
+		fprintf(fp, "\"line\": %d, \"page\": %d, \"y\": %.2f}",
+		        cmark_node_get_start_line(block->node), block->page,
+		        block->y);
+	}
+	fprintf(fp, "%s]}\n", pagination->count ? "\n" : "");
+	return !ferror(fp);
+}
+
+static int run_paginate(cmark_node *document, int options,
+			const cmark_pdf_config *config, const char *outfile)
+{
+	cmark_pdf_renderer *renderer;
+	cmark_pdf_pagination pagination;
+	FILE *fp;
+	int ok;
+
+	renderer = cmark_pdf_renderer_new(options, config);
+	if (renderer == NULL) {
+		return 1;
+	}
+	ok = cmark_pdf_paginate(renderer, document, &pagination);
+	cmark_pdf_renderer_free(renderer);
+	if (!ok) {
+		return 1;
+	}
+	if (strcmp(outfile, "-") == 0) {
+		fp = stdout;
+	} else {
+		fp = fopen(outfile, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "Error opening file %s: %s\n",
+			        outfile, strerror(errno));
+			cmark_pdf_pagination_free(&pagination);
+			return 1;
+		}
+	}
+	ok = write_pagination(fp, &pagination);
+	if (fp != stdout && fclose(fp) != 0) {
+		ok = 0;
+	}
+	cmark_pdf_pagination_free(&pagination);
+	return ok ? 0 : 1;
+}
+
+static void print_alloc_stats(const cmark_pdf_renderer *renderer)
+{
+	cmark_pdf_alloc_stats stats;
+
+	cmark_pdf_renderer_alloc_stats(renderer, &stats);
+	fprintf(stderr, "libharu: %lu allocations, %lu frees, %lu bytes "
+	        "in use, %lu at most, %lu reserved\n",
+	        (unsigned long)stats.allocations, (unsigned long)stats.frees,
+	        (unsigned long)stats.bytes, (unsigned long)stats.peak_bytes,
+	        (unsigned long)stats.reserved);
+}
+
 void print_usage()
 {
 	printf("Usage:   cmarkpdf [FILE*]\n");
 	printf("Options:\n");
-	printf("  --output, -o FILE Output filename\n");
+	printf("  --output, -o FILE Output filename, or - for stdout\n");
 	printf("  --sourcepos       Include source position attribute\n");
 	printf("  --hardbreaks      Treat newlines as hard line breaks\n");
 	printf("  --smart           Use smart punctuation\n");
+	printf("  --optimal-breaks  Break lines with the Knuth-Plass algorithm\n");
+	printf("  --image-dpi DPI   Downsample images to this resolution\n");
+	printf("  --compression N   Deflate streams at level 1-9 on --jobs threads, 0 for none\n");
+	printf("  --allocator NAME  Memory for libharu: system, arena or counting\n");
+	printf("  --batch FILE      Render each INPUT<tab>OUTPUT line of FILE\n");
+	printf("  --serve SOCKET    Render requests on a Unix domain socket\n");
+	printf("  --cache-dir DIR   Reuse PDFs rendered before from DIR\n");
+	printf("  --paginate        Write page count and block positions as JSON\n");
+	printf("  --shard           Render each level-1 section separately and merge\n");
+	printf("  --jobs N          Number of threads for --batch, --serve or layout\n");
 	printf("  --help, -h        Print usage information\n");
 	printf("  --version         Print version\n");
 }
@@ -30,18 +227,35 @@ int main(int argc, char *argv[])
 	int i, numfps = 0;
 	int *files;
 	int ok;
-	char buffer[4096];
-	cmark_parser *parser;
-	size_t bytes;
+	struct input *inputs;
+	int numinputs;
+	const char *text;
+	size_t len;
+	struct buffer input = { NULL, 0, 0 };
+	struct buffer copy = { NULL, 0, 0 };
+	struct output out;
+	char key[OUTPUT_CACHE_KEY_SIZE];
+	char *cache_dir = NULL;
+	int keyed;
+	int cached;
 	cmark_node *document;
 	char *outfile = NULL;
+	cmark_pdf_renderer *renderer;
+	char *manifest = NULL;
+	char *socket_path = NULL;
+	int jobs = 0;
+	int threads;
+	int paginate = 0;
+	int shard = 0;
 	int options = CMARK_OPT_DEFAULT | CMARK_OPT_SAFE | CMARK_OPT_NORMALIZE;
+	cmark_pdf_config config;
 
 #if defined(_WIN32) && !defined(__CYGWIN__)
 	_setmode(_fileno(stdout), _O_BINARY);
 #endif
 
 	files = (int *)malloc(argc * sizeof(*files));
+	cmark_pdf_config_init(&config);
 
 	for (i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--version") == 0) {
@@ -54,6 +268,12 @@ int main(int argc, char *argv[])
 			options |= CMARK_OPT_HARDBREAKS;
 		} else if (strcmp(argv[i], "--smart") == 0) {
 			options |= CMARK_OPT_SMART;
+		} else if (strcmp(argv[i], "--optimal-breaks") == 0) {
+			options |= CMARK_PDF_OPT_OPTIMAL_BREAKS;
+		} else if (strcmp(argv[i], "--shard") == 0) {
+			shard = 1;
+		} else if (strcmp(argv[i], "--paginate") == 0) {
+			paginate = 1;
 		} else if (strcmp(argv[i], "--validate-utf8") == 0) {
 			options |= CMARK_OPT_VALIDATE_UTF8;
 		} else if ((strcmp(argv[i], "--help") == 0) ||
@@ -70,6 +290,81 @@ int main(int argc, char *argv[])
 				        argv[i - 1]);
 				exit(1);
 			}
+		} else if (strcmp(argv[i], "--image-dpi") == 0) {
+			i += 1;
+			if (i < argc) {
+				config.image_dpi = atoi(argv[i]);
+			} else {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--compression") == 0) {
+			i += 1;
+			if (i < argc) {
+				config.compression_level = atoi(argv[i]);
+			} else {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			}
+			if (config.compression_level < 0 ||
+			    config.compression_level > 9) {
+				fprintf(stderr, "Compression level must be 0 to 9\n");
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--allocator") == 0) {
+			i += 1;
+			if (i >= argc) {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			} else if (strcmp(argv[i], "system") == 0) {
+				config.allocator = CMARK_PDF_ALLOC_SYSTEM;
+			} else if (strcmp(argv[i], "arena") == 0) {
+				config.allocator = CMARK_PDF_ALLOC_ARENA;
+			} else if (strcmp(argv[i], "counting") == 0) {
+				config.allocator = CMARK_PDF_ALLOC_COUNTING;
+			} else {
+				fprintf(stderr, "Unknown allocator %s\n", argv[i]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			i += 1;
+			if (i < argc) {
+				manifest = argv[i];
+			} else {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--serve") == 0) {
+			i += 1;
+			if (i < argc) {
+				socket_path = argv[i];
+			} else {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--cache-dir") == 0) {
+			i += 1;
+			if (i < argc) {
+				cache_dir = argv[i];
+			} else {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			}
+		} else if (strcmp(argv[i], "--jobs") == 0) {
+			i += 1;
+			if (i < argc) {
+				jobs = atoi(argv[i]);
+			} else {
+				fprintf(stderr, "No argument provided for %s\n",
+				        argv[i - 1]);
+				exit(1);
+			}
 		} else if (*argv[i] == '-') {
 			print_usage();
 			exit(1);
@@ -78,46 +373,127 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	threads = jobs > 0 ? jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (manifest) {
+		free(files);
+		return run_batch(manifest, options, &config, threads,
+				 cache_dir);
+	}
+	if (socket_path) {
+		free(files);
+		return serve(socket_path, options, &config, threads);
+	}
+
+	// one document: its streams are deflated in parallel, and its
+	// blocks laid out in parallel only if --jobs asks for it
+	config.layout_threads = jobs;
+	config.compression_threads = threads;
+
+	if (!outfile && paginate) {
+		outfile = "-";
+	}
 	if (!outfile) {
 		fprintf(stderr, "Specify an output file with -o/--output\n");
 		exit(1);
 	}
 
-	parser = cmark_parser_new(options);
-	for (i = 0; i < numfps; i++) {
-		FILE *fp = fopen(argv[files[i]], "r");
-		if (fp == NULL) {
-			fprintf(stderr, "Error opening file %s: %s\n",
-			        argv[files[i]], strerror(errno));
+	// map every file before parsing any, so that the later ones are
+	// read in while the first is parsed
+	numinputs = numfps ? numfps : 1;
+	inputs = (struct input *)malloc(numinputs * sizeof(*inputs));
+	if (inputs == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < numinputs; i++) {
+		if (!input_open(numfps ? argv[files[i]] : NULL, &inputs[i])) {
+			fprintf(stderr, "Error reading %s: %s\n",
+			        numfps ? argv[files[i]] : "stdin",
+			        strerror(errno));
 			exit(1);
 		}
+	}
 
-		while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-			cmark_parser_feed(parser, buffer, bytes);
-			if (bytes < sizeof(buffer)) {
-				break;
+	// the cache key covers the whole input, so several inputs are
+	// joined for it; sharded output differs, and isn't cached
+	keyed = 0;
+	if (cache_dir && !shard && !paginate) {
+		text = inputs[0].data;
+		len = inputs[0].len;
+		if (numinputs > 1) {
+			for (i = 0; i < numinputs; i++) {
+				if (!append(&input, inputs[i].data,
+				            inputs[i].len)) {
+					fprintf(stderr, "Out of memory\n");
+					exit(1);
+				}
 			}
+			text = input.data;
+			len = input.len;
 		}
-
-		fclose(fp);
+		keyed = output_cache_key(text, len, options, &config, key);
+		free(input.data);
+	}
+	cached = keyed ? output_cache_fetch(cache_dir, key, outfile) : 0;
+	if (cached < 0) {
+		// part of it may have been written, so don't add another
+		fprintf(stderr, "Error writing %s\n", outfile);
+		exit(1);
+	}
+	document = cached ? NULL :
+		parse_inputs(inputs, numinputs, options);
+	for (i = 0; i < numinputs; i++) {
+		input_close(&inputs[i]);
+	}
+	free(inputs);
+	free(files);
+	if (cached) {
+		return 0;
 	}
 
-	if (numfps == 0) {
+	if (paginate) {
+		ok = run_paginate(document, options, &config, outfile);
+		cmark_node_free(document);
+		return ok;
+	}
 
-		while ((bytes = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
-			cmark_parser_feed(parser, buffer, bytes);
-			if (bytes < sizeof(buffer)) {
-				break;
-			}
+	renderer = NULL;
+	if (!shard) {
+		renderer = cmark_pdf_renderer_new(options, &config);
+		if (renderer == NULL) {
+			exit(1);
 		}
 	}
+	if (strcmp(outfile, "-") == 0) {
+		out.fp = stdout;
+	} else {
+		out.fp = fopen(outfile, "wb");
+		if (out.fp == NULL) {
+			fprintf(stderr, "Error opening file %s: %s\n",
+			        outfile, strerror(errno));
+			exit(1);
+		}
+	}
+	out.copy = keyed ? &copy : NULL;
+	if (shard) {
+		ok = render_sharded(document, options, &config, threads,
+		                    write_output, &out);
+	} else {
+		ok = cmark_pdf_render(renderer, document, write_output, &out);
+	}
+	if (out.fp != stdout && fclose(out.fp) != 0) {
+		ok = 0;
+	}
+	if (renderer && config.allocator == CMARK_PDF_ALLOC_COUNTING) {
+		print_alloc_stats(renderer);
+	}
+	cmark_pdf_renderer_free(renderer);
+	if (ok && keyed) {
+		output_cache_store(cache_dir, key,
+		                   (const unsigned char *)copy.data, copy.len);
+	}
+	free(copy.data);
 
-	document = cmark_parser_finish(parser);
-	cmark_parser_free(parser);
-
-	ok = cmark_render_pdf(document, options, outfile);
-
-	free(files);
 	cmark_node_free(document);
 
 	return ok ? 0 : 1;
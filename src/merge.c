@@ -0,0 +1,1077 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "merge.h"
+#include "sha256.h"
+
+// Only what libharu writes is understood: one cross-reference table,
+// objects of generation 0, and a page tree that holds no attributes
+// for its pages to inherit.
+
+// numbers of the objects written last
+#define CATALOG 1
+#define PAGES 2
+
+#define MAX_PAGE_TREE_DEPTH 32
+
+enum visit {
+	UNSEEN,
+	VISITING,
+	DONE
+};
+
+struct pdf_object {
+	size_t start;   // offset of "N 0 obj", or 0 if unused
+	size_t end;     // offset of the next object or the xref
+	long number;    // in the merged PDF, or 0 if not given one yet
+	unsigned char visit;
+	size_t data;    // offset of the stream data, if it is to be deflated
+	size_t data_len;
+	unsigned char * deflated;  // then, the data deflated
+	size_t deflated_len;
+};
+
+struct source {
+	const unsigned char * data;
+	size_t len;
+	struct pdf_object * objects;
+	size_t count;
+	size_t first;   // offset of the first object
+	long root;
+	long info;
+	long * pages;   // in order
+	size_t numpages;
+	size_t pages_size;
+};
+
+struct bytes {
+	unsigned char * data;
+	size_t len;
+	size_t size;
+};
+
+// An object written that later ones can be replaced with, known by
+// the digest of its bytes.
+struct written {
+	unsigned char digest[SHA256_SIZE];
+	size_t len;
+	long number;
+};
+
+struct merger {
+	cmark_pdf_write_func write;
+	void * userdata;
+	bool ok;
+	size_t offset;       // of the next byte written
+	size_t * offsets;    // of the objects written, by number
+	size_t offsets_size;
+	long numbers;        // the last number given out
+	struct written * table;
+	size_t table_count;
+	size_t table_size;
+	long * pages;
+	size_t numpages;
+	size_t pages_size;
+};
+
+static long resolve(struct merger *m, struct source *src, long n);
+
+static int
+bytes_append(struct bytes *b, const void *data, size_t len)
+{
+	unsigned char * p;
+	size_t size;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 256;
+		while (size < b->len + len) {
+			size *= 2;
+		}
+		p = (unsigned char*)realloc(b->data, size);
+		if (p == NULL) {
+			return 0;
+		}
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 1;
+}
+
+static int
+append_long(long **array, size_t *count, size_t *size, long value)
+{
+	long * p;
+
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 64;
+		p = (long*)realloc(*array, *size * sizeof(**array));
+		if (p == NULL) {
+			return 0;
+		}
+		*array = p;
+	}
+	(*array)[(*count)++] = value;
+	return 1;
+}
+
+static void
+emit(struct merger *m, const void *data, size_t len)
+{
+	if (m->ok && !m->write((const unsigned char*)data, len,
+			       m->userdata)) {
+		m->ok = false;
+	}
+	m->offset += len;
+}
+
+static void
+emit_string(struct merger *m, const char *s)
+{
+	emit(m, s, strlen(s));
+}
+
+// Note that object number starts here.
+static void
+start_object(struct merger *m, long number)
+{
+	char line[32];
+	size_t * p;
+	size_t size;
+
+	if ((size_t)number >= m->offsets_size) {
+		size = m->offsets_size ? m->offsets_size : 256;
+		while (size <= (size_t)number) {
+			size *= 2;
+		}
+		p = (size_t*)realloc(m->offsets, size * sizeof(*p));
+		if (p == NULL) {
+			m->ok = false;
+			return;
+		}
+		memset(p + m->offsets_size, 0,
+		       (size - m->offsets_size) * sizeof(*p));
+		m->offsets = p;
+		m->offsets_size = size;
+	}
+	m->offsets[number] = m->offset;
+	snprintf(line, sizeof(line), "%ld 0 obj\n", number);
+	emit_string(m, line);
+}
+
+static bool
+is_space(unsigned char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t' ||
+		c == '\f' || c == '\0';
+}
+
+static bool
+is_delimiter(unsigned char c)
+{
+	return c != '\0' && strchr("()<>[]{}/%", c) != NULL;
+}
+
+static const unsigned char *
+skip_space(const unsigned char *p, const unsigned char *end)
+{
+	while (p < end && is_space(*p)) {
+		p++;
+	}
+	return p;
+}
+
+// Read a non-negative integer after any space, moving *p past it.
+static bool
+read_long(const unsigned char **p, const unsigned char *end, long *value)
+{
+	const unsigned char * q = skip_space(*p, end);
+
+	if (q == end || *q < '0' || *q > '9') {
+		return false;
+	}
+	*value = 0;
+	while (q < end && *q >= '0' && *q <= '9') {
+		*value = *value * 10 + (*q - '0');
+		q++;
+	}
+	*p = q;
+	return true;
+}
+
+static bool
+read_ref(const unsigned char **p, const unsigned char *end, long *value)
+{
+	const unsigned char * q = *p;
+	long generation;
+
+	if (!read_long(&q, end, value) || !read_long(&q, end, &generation)) {
+		return false;
+	}
+	q = skip_space(q, end);
+	if (q == end || *q != 'R') {
+		return false;
+	}
+	*p = q + 1;
+	return true;
+}
+
+static bool
+is_token(const unsigned char *start, const unsigned char *end,
+	 const char *token)
+{
+	size_t len = strlen(token);
+
+	return (size_t)(end - start) == len && memcmp(start, token, len) == 0;
+}
+
+static const unsigned char *
+find(const unsigned char *p, const unsigned char *end, const char *s)
+{
+	size_t len = strlen(s);
+
+	while ((p = memchr(p, s[0], end - p)) != NULL) {
+		if ((size_t)(end - p) < len) {
+			return NULL;
+		}
+		if (memcmp(p, s, len) == 0) {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+// Find a key followed by a delimiter or space, so that "/Pages"
+// doesn't match "/PagesX".
+static const unsigned char *
+find_key(const unsigned char *p, const unsigned char *end, const char *key)
+{
+	size_t len = strlen(key);
+
+	while ((p = find(p, end, key)) != NULL) {
+		p += len;
+		if (p == end || is_space(*p) || is_delimiter(*p)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static int
+compare_offsets(const void *a, const void *b)
+{
+	size_t x = *(const size_t*)a;
+	size_t y = *(const size_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Read the cross-reference table and trailer.
+static int
+read_xref(struct source *src)
+{
+	const unsigned char * data = src->data;
+	const unsigned char * end = data + src->len;
+	const unsigned char * p;
+	const unsigned char * trailer;
+	struct pdf_object * objects;
+	size_t * starts;
+	size_t numstarts = 0;
+	long xref, first, count, offset, generation;
+	long i;
+	size_t lo, hi, mid;
+
+	// startxref is at the very end
+	p = NULL;
+	for (i = (long)src->len - 9; i >= 0 && i >= (long)src->len - 1024;
+	     i--) {
+		if (memcmp(data + i, "startxref", 9) == 0) {
+			p = data + i + 9;
+			break;
+		}
+	}
+	if (p == NULL || !read_long(&p, end, &xref) ||
+	    (size_t)xref + 4 > src->len ||
+	    memcmp(data + xref, "xref", 4) != 0) {
+		return 0;
+	}
+
+	p = data + xref + 4;
+	while (read_long(&p, end, &first)) {
+		if (!read_long(&p, end, &count) ||
+		    first + count > (long)src->len) {
+			return 0;
+		}
+		if ((size_t)(first + count) > src->count) {
+			objects = (struct pdf_object*)realloc(src->objects,
+					(first + count) * sizeof(*objects));
+			if (objects == NULL) {
+				return 0;
+			}
+			memset(objects + src->count, 0,
+			       (first + count - src->count) *
+			       sizeof(*objects));
+			src->objects = objects;
+			src->count = first + count;
+		}
+		for (i = first; i < first + count; i++) {
+			if (!read_long(&p, end, &offset) ||
+			    !read_long(&p, end, &generation)) {
+				return 0;
+			}
+			p = skip_space(p, end);
+			if (p == end) {
+				return 0;
+			}
+			if (*p == 'n' && i > 0) {
+				if (offset <= 0 || offset >= xref) {
+					return 0;
+				}
+				src->objects[i].start = offset;
+			}
+			p++;
+		}
+	}
+	trailer = find(p, end, "trailer");
+	if (trailer == NULL) {
+		return 0;
+	}
+	p = find_key(trailer, end, "/Root");
+	if (p == NULL || !read_ref(&p, end, &src->root)) {
+		return 0;
+	}
+	p = find_key(trailer, end, "/Info");
+	if (p == NULL || !read_ref(&p, end, &src->info)) {
+		src->info = 0;
+	}
+
+	// each object runs up to the next one, or to the xref
+	starts = (size_t*)malloc((src->count + 1) * sizeof(*starts));
+	if (starts == NULL) {
+		return 0;
+	}
+	for (i = 0; i < (long)src->count; i++) {
+		if (src->objects[i].start) {
+			starts[numstarts++] = src->objects[i].start;
+		}
+	}
+	starts[numstarts++] = xref;
+	qsort(starts, numstarts, sizeof(*starts), compare_offsets);
+	src->first = starts[0];
+	for (i = 0; i < (long)src->count; i++) {
+		if (!src->objects[i].start) {
+			continue;
+		}
+		lo = 0;
+		hi = numstarts;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (starts[mid] <= src->objects[i].start) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		src->objects[i].end = starts[lo < numstarts ? lo : numstarts - 1];
+	}
+	free(starts);
+	return 1;
+}
+
+// Find the value of object n, from after "N 0 obj" to before
+// "endobj".
+static int
+object_body(struct source *src, long n, const unsigned char **body,
+	    const unsigned char **body_end)
+{
+	struct pdf_object * obj;
+	const unsigned char * p;
+	const unsigned char * end;
+	long number, generation;
+
+	if (n <= 0 || (size_t)n >= src->count || !src->objects[n].start) {
+		return 0;
+	}
+	obj = &src->objects[n];
+	p = src->data + obj->start;
+	end = src->data + obj->end;
+	if (!read_long(&p, end, &number) || number != n ||
+	    !read_long(&p, end, &generation)) {
+		return 0;
+	}
+	p = skip_space(p, end);
+	if (end - p < 3 || memcmp(p, "obj", 3) != 0) {
+		return 0;
+	}
+	p = skip_space(p + 3, end);
+	while (end - p >= 6 && memcmp(end - 6, "endobj", 6) != 0) {
+		end--;
+	}
+	if (end - p < 6) {
+		return 0;
+	}
+	*body = p;
+	*body_end = end - 6;
+	return 1;
+}
+
+static bool
+has_type(struct source *src, long n, const char *type)
+{
+	const unsigned char * p;
+	const unsigned char * end;
+	const unsigned char * start;
+
+	if (!object_body(src, n, &p, &end) ||
+	    (p = find_key(p, end, "/Type")) == NULL) {
+		return false;
+	}
+	p = skip_space(p, end);
+	start = p;
+	if (p < end && *p == '/') {
+		p++;
+	}
+	while (p < end && !is_space(*p) && !is_delimiter(*p)) {
+		p++;
+	}
+	return is_token(start, p, type);
+}
+
+// Add the pages under the page tree node n to src->pages.  Every node
+// becomes the merged PDF's one, so pages' /Parent entries point at it.
+static int
+collect_pages(struct source *src, long n, int depth)
+{
+	const unsigned char * p;
+	const unsigned char * end;
+	long kid;
+
+	if (depth > MAX_PAGE_TREE_DEPTH || !object_body(src, n, &p, &end)) {
+		return 0;
+	}
+	src->objects[n].number = PAGES;
+	src->objects[n].visit = DONE;
+
+	p = find_key(p, end, "/Kids");
+	if (p == NULL) {
+		return 0;
+	}
+	p = skip_space(p, end);
+	if (p == end || *p != '[') {
+		return 0;
+	}
+	p++;
+	while (read_ref(&p, end, &kid)) {
+		if (has_type(src, kid, "/Pages")) {
+			if (!collect_pages(src, kid, depth + 1)) {
+				return 0;
+			}
+		} else if (!append_long(&src->pages, &src->numpages,
+					&src->pages_size, kid)) {
+			return 0;
+		}
+	}
+	p = skip_space(p, end);
+	return p < end && *p == ']';
+}
+
+static bool
+is_integer(const unsigned char *start, const unsigned char *end)
+{
+	if (start == end) {
+		return false;
+	}
+	while (start < end) {
+		if (*start < '0' || *start > '9') {
+			return false;
+		}
+		start++;
+	}
+	return true;
+}
+
+// Move *pp past the token it points at, which must not be space,
+// keeping track of how deep in dictionaries and arrays it is.
+static int
+next_token(const unsigned char **pp, const unsigned char *end, int *depth)
+{
+	const unsigned char * p = *pp;
+	const unsigned char * start = p;
+	int nesting;
+
+	switch (*p) {
+	case '(':
+		nesting = 0;
+		do {
+			if (*p == '\\') {
+				p++;
+			} else if (*p == '(') {
+				nesting++;
+			} else if (*p == ')') {
+				nesting--;
+			}
+			p++;
+		} while (p < end && nesting > 0);
+		if (nesting > 0) {
+			return 0;
+		}
+		break;
+	case '<':
+		if (p + 1 < end && p[1] == '<') {
+			p += 2;
+			(*depth)++;
+		} else {
+			p = memchr(p, '>', end - p);
+			if (p == NULL) {
+				return 0;
+			}
+			p++;
+		}
+		break;
+	case '>':
+		if (p + 1 == end || p[1] != '>') {
+			return 0;
+		}
+		p += 2;
+		(*depth)--;
+		break;
+	case '[':
+		p++;
+		(*depth)++;
+		break;
+	case ']':
+		p++;
+		(*depth)--;
+		break;
+	case '/':
+		p++;
+		while (p < end && !is_space(*p) && !is_delimiter(*p)) {
+			p++;
+		}
+		break;
+	default:
+		while (p < end && !is_space(*p) && !is_delimiter(*p)) {
+			p++;
+		}
+		if (p == start) {
+			return 0;
+		}
+		break;
+	}
+	*pp = p;
+	return 1;
+}
+
+// Move *pp past the value it points at.
+static int
+skip_value(const unsigned char **pp, const unsigned char *end)
+{
+	int depth = 0;
+
+	do {
+		*pp = skip_space(*pp, end);
+		if (*pp == end || !next_token(pp, end, &depth)) {
+			return 0;
+		}
+	} while (depth > 0);
+	return 1;
+}
+
+// Copy the value at *pp to out, with each reference renumbered, and
+// move *pp past it.  Pages, page tree nodes, annotations and catalogs
+// must not be shared, so *shared is cleared for them.  If drop_length
+// is set, the /Length entry of the dictionary is left out.
+static int
+rewrite_value(struct merger *m, struct source *src,
+	      const unsigned char **pp, const unsigned char *end,
+	      struct bytes *out, bool *shared, bool drop_length)
+{
+	const unsigned char * p = *pp;
+	const unsigned char * start;
+	size_t ints[2];    // where the integers just copied start in out
+	long values[2];
+	int numints = 0;
+	bool type_key = false;
+	int depth = 0;
+	char ref[32];
+	long number;
+	size_t mark;
+	const unsigned char * q;
+
+	do {
+		mark = out->len;
+		start = p;
+		p = skip_space(p, end);
+		if (p > start && !bytes_append(out, start, p - start)) {
+			return 0;
+		}
+		if (p == end) {
+			return 0;
+		}
+		start = p;
+		if (!next_token(&p, end, &depth)) {
+			return 0;
+		}
+
+		if (drop_length && depth == 1 && is_token(start, p, "/Length")) {
+			if (!read_ref(&p, end, &number) &&
+			    !read_long(&p, end, &number)) {
+				return 0;
+			}
+			out->len = mark;
+			numints = 0;
+			type_key = false;
+			continue;
+		}
+		if (numints == 2 && is_token(start, p, "R")) {
+			number = resolve(m, src, values[0]);
+			if (number == 0) {
+				return 0;
+			}
+			out->len = ints[0];
+			snprintf(ref, sizeof(ref), "%ld 0 R", number);
+			if (!bytes_append(out, ref, strlen(ref))) {
+				return 0;
+			}
+			numints = 0;
+			type_key = false;
+			continue;
+		}
+		if (is_integer(start, p)) {
+			if (numints == 2) {
+				ints[0] = ints[1];
+				values[0] = values[1];
+				numints = 1;
+			}
+			q = start;
+			read_long(&q, p, &values[numints]);
+			ints[numints++] = out->len;
+		} else {
+			numints = 0;
+		}
+		if (type_key && depth == 1 &&
+		    (is_token(start, p, "/Page") ||
+		     is_token(start, p, "/Pages") ||
+		     is_token(start, p, "/Annot") ||
+		     is_token(start, p, "/Catalog"))) {
+			*shared = false;
+		}
+		type_key = depth == 1 && is_token(start, p, "/Type");
+		if (!bytes_append(out, start, p - start)) {
+			return 0;
+		}
+	} while (depth > 0);
+
+	*pp = p;
+	return 1;
+}
+
+// Note where the data of object n is if it is a stream with no
+// filter that is worth deflating.
+static bool
+find_stream(struct source *src, long n)
+{
+	struct pdf_object * obj = &src->objects[n];
+	const unsigned char * body;
+	const unsigned char * end;
+	const unsigned char * dict_end;
+	const unsigned char * p;
+	const unsigned char * q;
+	long length, ref;
+
+	if (!object_body(src, n, &body, &end) || end - body < 2 ||
+	    memcmp(body, "<<", 2) != 0) {
+		return false;
+	}
+	p = body;
+	if (!skip_value(&p, end)) {
+		return false;
+	}
+	dict_end = p;
+	p = skip_space(p, end);
+	if (end - p < 6 || memcmp(p, "stream", 6) != 0 ||
+	    find_key(body, dict_end, "/Filter") != NULL) {
+		return false;
+	}
+	p += 6;
+	if (p < end && *p == '\r') {
+		p++;
+	}
+	if (p < end && *p == '\n') {
+		p++;
+	}
+
+	// libharu writes the length as an object of its own
+	q = find_key(body, dict_end, "/Length");
+	if (q == NULL) {
+		return false;
+	}
+	if (read_ref(&q, dict_end, &ref)) {
+		if (!object_body(src, ref, &q, &dict_end) ||
+		    !read_long(&q, dict_end, &length)) {
+			return false;
+		}
+	} else if (!read_long(&q, dict_end, &length)) {
+		return false;
+	}
+	if (length == 0 || length > end - p) {
+		return false;
+	}
+	obj->data = p - src->data;
+	obj->data_len = length;
+	return true;
+}
+
+struct deflate_pool {
+	struct source * src;
+	long * objects;
+	size_t count;
+	size_t next;  // next object to claim
+	int level;
+};
+
+static void *
+run_deflate(void *arg)
+{
+	struct deflate_pool * pool = (struct deflate_pool*)arg;
+	struct pdf_object * obj;
+	unsigned char * out;
+	uLongf len;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1,
+				       __ATOMIC_RELAXED)) < pool->count) {
+		obj = &pool->src->objects[pool->objects[i]];
+		len = compressBound(obj->data_len);
+		out = (unsigned char*)malloc(len);
+		if (out == NULL) {
+			continue;
+		}
+		// a stream that can't be deflated is copied as it is
+		if (compress2(out, &len, pool->src->data + obj->data,
+			      obj->data_len, pool->level) != Z_OK) {
+			free(out);
+			continue;
+		}
+		obj->deflated = out;
+		obj->deflated_len = len;
+	}
+	return NULL;
+}
+
+// Deflate the data of every stream in src with no filter, at level,
+// on up to threads threads.
+static int
+deflate_streams(struct source *src, int level, int threads)
+{
+	struct deflate_pool pool = { src, NULL, 0, 0, level };
+	size_t size = 0;
+	pthread_t * workers;
+	int started = 0;
+	int i;
+	long n;
+
+	for (n = 1; n < (long)src->count; n++) {
+		if (find_stream(src, n) &&
+		    !append_long(&pool.objects, &pool.count, &size, n)) {
+			free(pool.objects);
+			return 0;
+		}
+	}
+	if ((size_t)threads > pool.count) {
+		threads = pool.count;
+	}
+	// the calling thread is the first worker
+	workers = threads > 1 ?
+		(pthread_t*)malloc((threads - 1) * sizeof(*workers)) : NULL;
+	if (workers) {
+		for (i = 0; i < threads - 1; i++) {
+			if (pthread_create(&workers[i], NULL, run_deflate,
+					   &pool) != 0) {
+				break;
+			}
+			started++;
+		}
+	}
+	run_deflate(&pool);
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	free(pool.objects);
+	return 1;
+}
+
+// Close the dictionary of a stream that had its /Length left out, and
+// add the deflated data.
+static int
+append_deflated(struct bytes *out, struct pdf_object *obj)
+{
+	char line[64];
+
+	if (out->len < 2 || memcmp(out->data + out->len - 2, ">>", 2) != 0) {
+		return 0;
+	}
+	out->len -= 2;
+	snprintf(line, sizeof(line),
+		 "/Filter /FlateDecode\n/Length %lu\n>>\nstream\r\n",
+		 (unsigned long)obj->deflated_len);
+	return bytes_append(out, line, strlen(line)) &&
+		bytes_append(out, obj->deflated, obj->deflated_len) &&
+		bytes_append(out, "\r\nendstream\n", 12);
+}
+
+// Where to start looking for digest in a table of size entries.
+static size_t
+written_slot(const unsigned char *digest, size_t size)
+{
+	uint64_t h;
+
+	memcpy(&h, digest, sizeof(h));
+	return h & (size - 1);
+}
+
+static long
+find_written(struct merger *m, const unsigned char *digest, size_t len)
+{
+	size_t i;
+
+	if (m->table_size == 0) {
+		return 0;
+	}
+	for (i = written_slot(digest, m->table_size); m->table[i].number;
+	     i = (i + 1) & (m->table_size - 1)) {
+		if (m->table[i].len == len &&
+		    memcmp(m->table[i].digest, digest, SHA256_SIZE) == 0) {
+			return m->table[i].number;
+		}
+	}
+	return 0;
+}
+
+// Not remembering an object only costs a copy of it.
+static void
+add_written(struct merger *m, const unsigned char *digest, size_t len,
+	    long number)
+{
+	struct written * table;
+	size_t size;
+	size_t i, j;
+
+	if (2 * (m->table_count + 1) > m->table_size) {
+		size = m->table_size ? m->table_size * 2 : 256;
+		table = (struct written*)calloc(size, sizeof(*table));
+		if (table == NULL) {
+			return;
+		}
+		for (i = 0; i < m->table_size; i++) {
+			if (!m->table[i].number) {
+				continue;
+			}
+			for (j = written_slot(m->table[i].digest, size);
+			     table[j].number;
+			     j = (j + 1) & (size - 1))
+				;
+			table[j] = m->table[i];
+		}
+		free(m->table);
+		m->table = table;
+		m->table_size = size;
+	}
+	for (i = written_slot(digest, m->table_size); m->table[i].number;
+	     i = (i + 1) & (m->table_size - 1))
+		;
+	memcpy(m->table[i].digest, digest, SHA256_SIZE);
+	m->table[i].len = len;
+	m->table[i].number = number;
+	m->table_count++;
+}
+
+// Write object n of src, and everything it refers to first, unless
+// the same bytes have been written already.  Returns its number in
+// the merged PDF, or 0 on failure.
+static long
+resolve(struct merger *m, struct source *src, long n)
+{
+	struct pdf_object * obj;
+	struct bytes out = { NULL, 0, 0 };
+	const unsigned char * p;
+	const unsigned char * end;
+	bool shared = true;
+	unsigned char digest[SHA256_SIZE];
+	long number;
+
+	if (n <= 0 || (size_t)n >= src->count || !src->objects[n].start) {
+		return 0;
+	}
+	obj = &src->objects[n];
+	if (obj->visit == DONE) {
+		return obj->number;
+	}
+	if (obj->visit == VISITING) {
+		// referred to from something it refers to: it keeps the
+		// number given here
+		if (!obj->number) {
+			obj->number = ++m->numbers;
+		}
+		return obj->number;
+	}
+	obj->visit = VISITING;
+
+	if (!object_body(src, n, &p, &end) ||
+	    !rewrite_value(m, src, &p, end, &out, &shared,
+			   obj->deflated != NULL) ||
+	    !(obj->deflated ? append_deflated(&out, obj) :
+	      bytes_append(&out, p, end - p))) {
+		free(out.data);
+		return 0;
+	}
+	number = 0;
+	if (shared) {
+		sha256(out.data, out.len, digest);
+	}
+	if (shared && !obj->number) {
+		number = find_written(m, digest, out.len);
+	}
+	if (number) {
+		obj->number = number;
+	} else {
+		if (!obj->number) {
+			obj->number = ++m->numbers;
+		}
+		start_object(m, obj->number);
+		emit(m, out.data, out.len);
+		emit_string(m, "endobj\n");
+		if (shared) {
+			add_written(m, digest, out.len, obj->number);
+		}
+	}
+	obj->visit = DONE;
+	free(out.data);
+	return obj->number;
+}
+
+// Write the pages of src, and the header too if it is the first.
+static int
+merge_source(struct merger *m, struct source *src, bool first,
+	     long *info, int level, int threads)
+{
+	const unsigned char * p;
+	const unsigned char * end;
+	long pages;
+	long number;
+	size_t i;
+
+	if (!read_xref(src) || !object_body(src, src->root, &p, &end) ||
+	    (p = find_key(p, end, "/Pages")) == NULL ||
+	    !read_ref(&p, end, &pages) || !collect_pages(src, pages, 0)) {
+		return 0;
+	}
+	if (level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION &&
+	    !deflate_streams(src, level, threads)) {
+		return 0;
+	}
+	if (first) {
+		// "%PDF-1.x" and the line marking the file as binary
+		emit(m, src->data, src->first);
+		if (src->info) {
+			*info = resolve(m, src, src->info);
+		}
+	}
+	for (i = 0; i < src->numpages; i++) {
+		number = resolve(m, src, src->pages[i]);
+		if (number == 0 ||
+		    !append_long(&m->pages, &m->numpages, &m->pages_size,
+				 number)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int merge_pdfs(const unsigned char **pdfs, const size_t *lens,
+	       size_t count, int level, int threads,
+	       cmark_pdf_write_func write, void *userdata)
+{
+	struct merger m = { };
+	struct source src;
+	char line[64];
+	long info = 0;
+	size_t i;
+	long n;
+
+	m.write = write;
+	m.userdata = userdata;
+	m.ok = true;
+	m.numbers = PAGES;
+
+	for (i = 0; i < count && m.ok; i++) {
+		memset(&src, 0, sizeof(src));
+		src.data = pdfs[i];
+		src.len = lens[i];
+		if (!merge_source(&m, &src, i == 0, &info, level, threads)) {
+			fprintf(stderr, "Could not merge part %lu\n",
+				(unsigned long)i + 1);
+			m.ok = false;
+		}
+		for (n = 1; n < (long)src.count; n++) {
+			free(src.objects[n].deflated);
+		}
+		free(src.objects);
+		free(src.pages);
+	}
+
+	// the page tree and catalog, which the pages refer to
+	start_object(&m, PAGES);
+	emit_string(&m, "<<\n/Type /Pages\n/Kids [");
+	for (i = 0; i < m.numpages; i++) {
+		snprintf(line, sizeof(line), "%s%ld 0 R", i ? " " : "",
+			 m.pages[i]);
+		emit_string(&m, line);
+	}
+	snprintf(line, sizeof(line), "]\n/Count %lu\n>>\nendobj\n",
+		 (unsigned long)m.numpages);
+	emit_string(&m, line);
+	start_object(&m, CATALOG);
+	emit_string(&m, "<<\n/Type /Catalog\n/Pages 2 0 R\n>>\nendobj\n");
+
+	// every number given out has been written
+	for (n = 1; n <= m.numbers; n++) {
+		if ((size_t)n >= m.offsets_size || !m.offsets[n]) {
+			m.ok = false;
+		}
+	}
+	if (m.ok) {
+		i = m.offset;
+		snprintf(line, sizeof(line), "xref\n0 %ld\n", m.numbers + 1);
+		emit_string(&m, line);
+		emit_string(&m, "0000000000 65535 f\r\n");
+		for (n = 1; n <= m.numbers; n++) {
+			snprintf(line, sizeof(line), "%010lu 00000 n\r\n",
+				 (unsigned long)m.offsets[n]);
+			emit_string(&m, line);
+		}
+		snprintf(line, sizeof(line), "trailer\n<<\n/Root %d 0 R\n",
+			 CATALOG);
+		emit_string(&m, line);
+		if (info) {
+			snprintf(line, sizeof(line), "/Info %ld 0 R\n", info);
+			emit_string(&m, line);
+		}
+		snprintf(line, sizeof(line), "/Size %ld\n>>\nstartxref\n%lu\n",
+			 m.numbers + 1, (unsigned long)i);
+		emit_string(&m, line);
+		emit_string(&m, "%%EOF\n");
+	}
+
+	free(m.offsets);
+	free(m.table);
+	free(m.pages);
+	return m.ok;
+}
@@ -0,0 +1,18 @@
+#ifndef CMARK_PDF_MERGE_H
+#define CMARK_PDF_MERGE_H
+
+#include <stddef.h>
+#include "pdf.h"
+
+// Concatenate the pages of count PDFs written by this renderer into
+// one PDF, passed to write.  The objects of each are renumbered, and
+// those that come out byte for byte the same, such as an image or a
+// font used the same way in several of them, are written once.
+// Objects no page uses are left out.  If level is 1 to 9, the data of
+// each stream with no filter is deflated at that level first, on up
+// to threads threads.  Returns 1 on success, 0 on failure.
+int merge_pdfs(const unsigned char **pdfs, const size_t *lens,
+	       size_t count, int level, int threads,
+	       cmark_pdf_write_func write, void *userdata);
+
+#endif
@@ -4,10 +4,18 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <cmark.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "hpdf.h"
 #include "pdf.h"
+#include "scan.h"
+#include "image.h"
+#include "merge.h"
+#include "alloc.h"
+#include "sha256.h"
 
 #if defined _LINUX
 #define FONT_PATH "/usr/share/fonts/truetype/dejavu/"
@@ -62,8 +70,9 @@ error_handler (HPDF_STATUS   error_no,
                HPDF_STATUS   detail_no,
                void         *user_data)
 {
-    printf ("ERROR: error_no=%04X, detail_no=%u\n",
-	    (HPDF_UINT)error_no, (HPDF_UINT)detail_no);
+    // not stdout, where the PDF itself may be going
+    fprintf (stderr, "ERROR: error_no=%04X, detail_no=%u\n",
+	     (HPDF_UINT)error_no, (HPDF_UINT)detail_no);
 }
 
 enum box_type {
@@ -73,26 +82,87 @@ enum box_type {
 	IMAGE
 };
 
-struct box {
-	enum box_type type;
-	const char * text;
-	int len;
-	float width;
-	float height;
-	struct box * next;
-	int style;
-	const char * link_dest;
-	HPDF_Image image;
+// Boxes waiting to be laid out are kept in a growable buffer, one
+// array per field, so that line fitting is a scan over packed widths.
+// The arrays are reused from block to block and freed at the end.
+struct box_buffer {
+	unsigned char * types;   // enum box_type
+	unsigned char * styles;
+	float * widths;
+	float * heights;
+	const char ** texts;
+	int * lens;
+	const char ** link_dests;
+	size_t count;
+	size_t size;
 };
 
-typedef struct box box;
+static int
+box_buffer_grow(struct box_buffer *boxes)
+{
+	size_t size = boxes->size ? boxes->size * 2 : 256;
+	void * p;
+
+#define GROW(field) \
+	p = realloc(boxes->field, size * sizeof(*boxes->field)); \
+	if (p == NULL) { \
+		return STATUS_ERR; \
+	} \
+	boxes->field = p;
+
+	GROW(types);
+	GROW(styles);
+	GROW(widths);
+	GROW(heights);
+	GROW(texts);
+	GROW(lens);
+	GROW(link_dests);
+#undef GROW
+
+	boxes->size = size;
+	return STATUS_OK;
+}
+
+// Drop the first n boxes, moving the rest to the front.
+static void
+box_buffer_shift(struct box_buffer *boxes, size_t n)
+{
+	size_t rest = boxes->count - n;
+
+#define SHIFT(field) \
+	memmove(boxes->field, boxes->field + n, rest * sizeof(*boxes->field));
+
+	SHIFT(types);
+	SHIFT(styles);
+	SHIFT(widths);
+	SHIFT(heights);
+	SHIFT(texts);
+	SHIFT(lens);
+	SHIFT(link_dests);
+#undef SHIFT
+
+	boxes->count = rest;
+}
+
+static void
+box_buffer_free(struct box_buffer *boxes)
+{
+	free(boxes->types);
+	free(boxes->styles);
+	free(boxes->widths);
+	free(boxes->heights);
+	free(boxes->texts);
+	free(boxes->lens);
+	free(boxes->link_dests);
+	memset(boxes, 0, sizeof(*boxes));
+}
 
 /*
 // for diagnostics
 static void
-print_box(box * box)
+print_box(struct box_buffer * boxes, size_t i)
 {
-	switch (box->type) {
+	switch (boxes->types[i]) {
 	case TEXT:
 		printf("TEXT  ");
 		break;
@@ -108,635 +178,3060 @@ print_box(box * box)
 	default:
 		break;
 	}
-	printf("%5.2f|%2x|%s|\n", box->width, box->style, box->text);
+	printf("%5.2f|%2x|%.*s|\n", boxes->widths[i], boxes->styles[i],
+	       boxes->lens[i], boxes->texts[i]);
 };
 */
 
+// Advance widths (in 1/1000 em, as returned by HPDF_Font_TextWidth)
+// for each font, so that libharu only measures a character once.
+// Codepoints below 256 go in a dense table, the rest in an open
+// addressing hash keyed by codepoint + 1 (0 marks an empty slot).
+#define WIDTH_DENSE_SIZE 256
+
+struct width_cache {
+	bool ready;
+	float space;   // width of a SPACE box, before the 0.67 factor
+	float dense[WIDTH_DENSE_SIZE];
+	uint32_t * keys;
+	float * values;
+	size_t size;
+	size_t count;
+};
+
+// Parsing the TrueType fonts is most of the work for a short
+// document, so one libharu document is kept for as long as the
+// renderer and recycled with HPDF_NewDoc, which keeps the font
+// definitions it has loaded.  Their names, and the widths measured
+// with them, are kept here.  The allocator must be entered around
+// every use of the document.
+struct font_cache {
+	HPDF_Doc pdf;
+	const char * names[8];
+	struct width_cache widths[8];
+	struct pdf_allocator alloc;
+	// characters each render adds to the subset of each style, a bit
+	// per codepoint, or NULL; kept when the document is dropped
+	unsigned char * glyphs[8];
+};
+
+#define GLYPH_SET_SIZE (0x10000 / 8)
+
+// An arena only gives its memory back when its document is freed,
+// and a recycled document keeps adding to it, so once it has handed
+// out this much the document is dropped, to be made again, fonts and
+// all, by the next render.
+#define ARENA_MAX_BYTES (64 * 1024 * 1024)
+
+// Progress of the greedy line breaker through the pending boxes,
+// kept between calls so that lines can be emitted as soon as they
+// are complete.
+struct line_fit {
+	size_t end;          // boxes before this have been fitted
+	size_t last_nonspace;
+	float width;
+	int numspaces;
+	int numspaces_to_last_nonspace;
+	bool gobbling;       // skipping spaces after a line
+};
+
+// Layout turns the boxes of a top-level block into the operations
+// that place it on pages.  Nothing in them depends on where on the
+// page the block starts, and when they are to be kept they own copies
+// of their text, so a block's layout can be placed again in a later
+// render.
+enum layout_op {
+	OP_PARBREAK,  // move to a new paragraph, value below the last line
+	OP_LINE,      // a line of boxes, value high
+	OP_MARKER,    // a list item marker
+	OP_HRULE,     // a rule, value high
+	OP_SKIP       // move down by value
+};
+
+struct layout_item {
+	unsigned char op;
+	float font_size;
+	float indent;
+	float value;
+	float padding;  // OP_PARBREAK: space needed on the page
+	size_t start;   // OP_LINE: boxes start..end-1; OP_MARKER: text
+	size_t end;
+};
+
+struct laid_box {
+	unsigned char type;  // enum box_type
+	unsigned char style;
+	float width;
+	float height;
+	size_t text;         // offset in the block's text; image path
+	const char * src;    // or the text itself, if it wasn't copied
+	int len;
+	long link;           // offset of the link destination, or -1
+};
+
+struct block_layout {
+	struct layout_item * items;
+	size_t count;
+	size_t size;
+	struct laid_box * boxes;
+	size_t numboxes;
+	size_t boxes_size;
+	char * text;
+	size_t text_len;
+	size_t text_size;
+	const char * link_src;  // link destination copied last
+	long link;              // and its offset
+	unsigned char fonts[8];  // styles in the order first used
+	int numfonts;
+};
+
+// Laid-out blocks kept by a renderer between renders, keyed by the
+// SHA-256 digest of the block's content and the options, and dropped
+// once they go unused for LAYOUT_CACHE_AGE renders.
+#define LAYOUT_CACHE_AGE 4
+
+struct layout_key {
+	unsigned char digest[SHA256_SIZE];
+};
+
+struct layout_entry {
+	bool used;
+	struct layout_key key;
+	unsigned long last_render;
+	struct block_layout block;
+};
+
+struct layout_cache {
+	struct layout_entry * entries;
+	size_t count;
+	size_t size;
+	unsigned long render;  // renders so far
+};
+
+// Documents are laid out on no more threads than they have multiples
+// of this many top-level blocks.
+#define PARALLEL_LAYOUT_MIN_BLOCKS 32
+
+// Top-level blocks laid out per thread ahead of the one being placed,
+// which bounds the layouts held at once.
+#define PARALLEL_LAYOUT_BATCH 64
+
+struct layout_job {
+	cmark_node * node;
+	struct layout_key key;
+	bool ready;       // laid out, or found in the layout cache
+	bool cached;      // in the layout cache, so not laid out
+	bool unmeasured;  // so laid out again when placed
+	int status;
+	struct block_layout layout;
+};
+
+// The top-level blocks of a document, laid out by the threads of the
+// pool, and by the thread placing them while it waits for the next,
+// no more than window blocks ahead of it.  libharu is not thread-safe,
+// so threads measure with the font definitions, holding fonts_lock,
+// which the placing thread also holds while it uses the fonts.
+struct layout_pool {
+	struct layout_job * jobs;
+	size_t count;
+	size_t next;    // next job to claim
+	size_t placed;  // jobs placed so far
+	size_t window;
+	bool stop;      // after an error
+	pthread_mutex_t lock;
+	pthread_cond_t claimable;  // placed has moved, or stop is set
+	pthread_cond_t ready;      // a job is ready, or stop is set
+	pthread_mutex_t fonts_lock;
+	HPDF_FontDef defs[8];  // of the fonts loaded so far
+	int options;
+	const cmark_pdf_config * config;
+	struct font_cache * fonts;      // whose widths are only read
+	struct layout_cache * layouts;  // only read until the threads end
+};
+
+struct cmark_pdf_renderer {
+	int options;
+	cmark_pdf_config config;
+	struct font_cache fonts;
+	struct layout_cache layouts;
+};
+
+// used by cmark_render_pdf
+static struct font_cache default_fonts;
+
 struct render_state {
 	HPDF_Doc pdf;
 	const char* font_paths[8];
 	HPDF_Font fonts[8];
+	struct font_cache * font_cache;
+	struct width_cache * widths; // in the font cache
+	struct image_cache images;
 	HPDF_REAL base_font_size;
 	HPDF_REAL current_font_size;
 	HPDF_REAL leading;
-	HPDF_Page page;
 	float indent;
-	float x;
-	float y;
-	float last_text_y;
-	box * boxes_bottom;
-	box * boxes_top;
+	struct box_buffer boxes;
+	struct line_fit fit;
+	bool wrap;  // whether the current block is wrapped
+	float line_height;  // tallest box so far in the current block
+	struct block_layout layout;  // of the current top-level block
+	struct layout_cache * layouts;  // or NULL to lay out every block
+	bool copy_text;    // layouts are kept, so they need their own text
+	bool place_lines;  // place each line as soon as it is laid out
+	// while blocks are laid out in parallel, the widths in the font
+	// cache are only read, and those measured go in local_widths
+	struct layout_pool * pool;
+	struct width_cache local_widths[8];
+	bool unmeasured;  // a width could not be measured without the font
 	int list_indent_level;
+	int * item_numbers;  // next item number for each open list
+	int item_numbers_size;
 	int style;
+	int options;
+	cmark_pdf_config config;
 	const char* link_dest;
+
+	// placing laid-out blocks on pages
+	HPDF_Page page;
+	int pages;
+	float page_height;
+	float x;
+	float y;
+	float last_text_y;
+	HPDF_REAL font_size;  // of the item being placed
+	char * text_buf;   // text run being collected for ShowText
+	size_t text_buf_size;
+	size_t text_len;
+	HPDF_Font page_font;  // font and size last set on the page
+	HPDF_REAL page_font_size;
+
+	// if not NULL, blocks are only placed, not drawn, and where
+	// they go is added here
+	cmark_pdf_pagination * pagination;
+	size_t positions_size;
+	cmark_node * block;  // top-level block not yet added
 };
 
-// lazily load font
-static int
-load_font(struct render_state *state,
-	  int style)
+static void
+width_cache_free(struct width_cache *cache)
 {
-	const char * fontname;
-	const char * path;
+	free(cache->keys);
+	free(cache->values);
+	cache->keys = NULL;
+	cache->values = NULL;
+	cache->size = 0;
+	cache->count = 0;
+	cache->ready = false;
+}
 
-	if (state->fonts[style]) {
+static void
+set_font_paths(const char **paths)
+{
+	paths[0] = FONT_PATH MAIN_FONT ".ttf";
+	paths[BOLD] = FONT_PATH MAIN_FONT_B ".ttf";
+	paths[ITALIC] = FONT_PATH MAIN_FONT_I ".ttf";
+	paths[BOLD + ITALIC] = FONT_PATH MAIN_FONT_BI ".ttf";
+	paths[MONOSPACE] = FONT_PATH TT_FONT ".ttf";
+	paths[MONOSPACE + BOLD] = FONT_PATH TT_FONT_B ".ttf";
+	paths[MONOSPACE + ITALIC] = FONT_PATH TT_FONT_I ".ttf";
+	paths[MONOSPACE + BOLD + ITALIC] = FONT_PATH TT_FONT_BI ".ttf";
+}
+
+// Start a new document, creating the libharu object the first time.
+static int
+font_cache_open(struct font_cache *fonts)
+{
+	if (fonts->pdf) {
+		if (HPDF_NewDoc(fonts->pdf) != HPDF_OK) {
+			err("Cannot create PdfDoc object");
+		}
 		return STATUS_OK;
 	}
 
-	path = state->font_paths[style];
-
-	fontname = HPDF_LoadTTFontFromFile(state->pdf,
-					   path,
-					   HPDF_TRUE);
-	if (!fontname) {
-		errf("Could not load main font '%s'", path);
+	fonts->pdf = pdf_allocator_new_doc(&fonts->alloc, error_handler);
+	if (!fonts->pdf) {
+		pdf_allocator_release(&fonts->alloc);
+		err("Cannot create PdfDoc object");
 	}
 
-	state->fonts[style] = HPDF_GetFont (state->pdf, fontname, "UTF-8");
-	if (!state->fonts[style]) {
-		errf("Could not get font '%s'", fontname);
+	if (HPDF_UseUTFEncodings(fonts->pdf) != HPDF_OK) {
+		HPDF_Free (fonts->pdf);
+		fonts->pdf = NULL;
+		pdf_allocator_release(&fonts->alloc);
+		err("Cannot set UTF-8 encoding");
+	};
+	return STATUS_OK;
+}
+
+// libharu tags font subsets HPDFAA, HPDFAB, ... in the order the
+// fonts are loaded, so with fonts loaded as documents need them, the
+// tags would depend on what earlier renders used.  Each style gets
+// the tag it would have if all eight were loaded in order instead.
+static void
+font_cache_tag(struct font_cache *fonts, int style)
+{
+	HPDF_FontDef def = HPDF_Doc_FindFontDef(fonts->pdf,
+						fonts->names[style]);
+	char tag[] = "HPDFAA";
+	int n = style;
+	int i;
+
+	if (def == NULL) {
+		return;
 	}
+	// add n to the tag, in base 26
+	for (i = 5; i >= 0 && n > 0; i--) {
+		n += tag[i] - 'A';
+		tag[i] = 'A' + n % 26;
+		n /= 26;
+	}
+	HPDF_TTFontDef_SetTagName(def, tag);
+}
 
-	return STATUS_OK;
+// Name of the font at path, parsing it if this is its first use.
+static const char *
+font_cache_load(struct font_cache *fonts, const char *path, int style)
+{
+	if (!fonts->names[style]) {
+		fonts->names[style] = HPDF_LoadTTFontFromFile(fonts->pdf,
+							      path,
+							      HPDF_TRUE);
+		if (fonts->names[style]) {
+			font_cache_tag(fonts, style);
+		}
+	}
+	return fonts->names[style];
 }
 
-static int
-push_image_box(struct render_state *state,
-	       HPDF_Image image)
+static void
+font_cache_free(struct font_cache *fonts)
 {
-	box * new = (box*)malloc(sizeof(box));
-	if (new == NULL) {
-		err("Could not allocate box");
+	struct pdf_allocator * previous;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		width_cache_free(&fonts->widths[i]);
+		fonts->names[i] = NULL;
 	}
-	new->type = IMAGE;
-	new->style = 0;
-	new->text = NULL;
-	new->len = 0;
-	new->link_dest = NULL;
-	new->image = image;
-	new->width = HPDF_Image_GetWidth(image);
-	new->height = HPDF_Image_GetHeight(image);
-	new->next = NULL;
-	if (state->boxes_top != NULL) {
-		state->boxes_top->next = new;
-	}
-	state->boxes_top = new;
-	if (state->boxes_bottom == NULL) {
-		state->boxes_bottom = new;
+	if (fonts->pdf) {
+		previous = pdf_allocator_enter(&fonts->alloc);
+		HPDF_Free (fonts->pdf);
+		fonts->pdf = NULL;
+		pdf_allocator_release(&fonts->alloc);
+		pdf_allocator_leave(previous);
 	}
-	return STATUS_OK;
 }
 
-static int
-push_box(struct render_state *state,
-	 enum box_type type,
-	 const char * text,
-	 int style)
+// Free the pages of the document, keeping its fonts for the next one.
+static void
+font_cache_close(struct font_cache *fonts)
 {
-	HPDF_TextWidth width;
-	HPDF_Font font;
+	HPDF_FreeDoc (fonts->pdf);
+	if (fonts->alloc.kind == CMARK_PDF_ALLOC_ARENA &&
+	    fonts->alloc.stats.bytes > ARENA_MAX_BYTES) {
+		font_cache_free(fonts);
+	}
+}
 
-	if (load_font(state, style) == STATUS_ERR) {
-		return STATUS_ERR;
+// Hold the lock on the fonts, if threads are measuring with them.
+static void
+lock_fonts(struct render_state *state)
+{
+	if (state->pool) {
+		pthread_mutex_lock(&state->pool->fonts_lock);
 	}
-	font = state->fonts[style];
+}
 
-	box * new = (box*)malloc(sizeof(box));
-	if (new == NULL) {
-		err("Could not allocate box");
+static void
+unlock_fonts(struct render_state *state)
+{
+	if (state->pool) {
+		pthread_mutex_unlock(&state->pool->fonts_lock);
 	}
-	new->style = style;
-	new->type = type;
-	new->text = text;
-	new->len = text ? strlen(text) : 0;
-	new->link_dest = state->link_dest;
-	new->height = state->current_font_size + state->leading;
+}
 
-	if (new->type == SPACE) {
-		width = HPDF_Font_TextWidth(font, (HPDF_BYTE*)"i", 1);
-		if (!(style & MONOSPACE)) {
-			width.width *= 0.67;
-		}
-	} else {
-		width = HPDF_Font_TextWidth(font, (HPDF_BYTE*)text, new->len);
+static int
+load_font_locked(struct render_state *state, int style)
+{
+	const char * fontname;
+	const char * path;
+
+	path = state->font_paths[style];
+
+	fontname = font_cache_load(state->font_cache, path, style);
+	if (!fontname) {
+		errf("Could not load main font '%s'", path);
 	}
-	new->width = ( width.width * state->current_font_size ) / 1000;
-	new->next = NULL;
-	if (state->boxes_top != NULL) {
-		state->boxes_top->next = new;
+
+	state->fonts[style] = HPDF_GetFont (state->pdf, fontname, "UTF-8");
+	if (!state->fonts[style]) {
+		errf("Could not get font '%s'", fontname);
 	}
-	state->boxes_top = new;
-	if (state->boxes_bottom == NULL) {
-		state->boxes_bottom = new;
+	// measuring marks characters as used in the subset, so those
+	// only measured for spaces and breaks are always marked, whether
+	// their widths were cached or not
+	HPDF_Font_TextWidth(state->fonts[style], (HPDF_BYTE*)"i \n", 3);
+
+	if (state->pool) {
+		state->pool->defs[style] = HPDF_Doc_FindFontDef(state->pdf,
+								fontname);
 	}
 	return STATUS_OK;
 }
 
+// lazily load font; layout threads have no document to load it in
 static int
-render_text(struct render_state *state, const char *text, bool wrap, int style)
+load_font(struct render_state *state,
+	  int style)
 {
-	char * tok;
-	const char * next = text;
-	const char * last_tok = text;
-	int category = 0;
-	int last_category = 0;
 	int status;
 
-	while (1) {
-		switch (*next) {
-		case ' ':
-			category = 1;
-			break;
-		case '\n':
-			category = 2;
-			break;
-		case 0:
-			category = 0;
-			break;
-		default:
-			category = 3;
-		}
-		if (category != last_category && next > last_tok) {
-			// emit token from last_tok to next-1
-			tok = (char *)malloc((next - last_tok) + 1);
-			if (tok == NULL) {
-				err("Could not allocate token");
-			}
-			memcpy(tok, last_tok, next - last_tok);
-			tok[next - last_tok] = 0;
-			last_tok = next;
-			status = push_box(state, tok[0] == ' ' ?
-				      SPACE : (tok[0] == '\n' ?
-					       BREAK : TEXT), tok,
-					  style);
-			if (status == STATUS_ERR) {
-				return STATUS_ERR;
+	if (state->fonts[style] || !state->pdf) {
+		return STATUS_OK;
+	}
+	lock_fonts(state);
+	status = load_font_locked(state, style);
+	unlock_fonts(state);
+	return status;
+}
+
+// Mark the characters in the font cache's glyph sets as used in the
+// subsets of the document, loading the fonts they are in.
+static int
+mark_glyphs(struct render_state *state)
+{
+	struct font_cache * fonts = state->font_cache;
+	const char * name;
+	HPDF_FontDef def;
+	uint32_t c;
+	int style;
+
+	for (style = 0; style < 8; style++) {
+		if (fonts->glyphs[style] == NULL) {
+			continue;
+		}
+		name = font_cache_load(fonts, state->font_paths[style], style);
+		if (!name) {
+			errf("Could not load main font '%s'",
+			     state->font_paths[style]);
+		}
+		def = HPDF_Doc_FindFontDef(state->pdf, name);
+		for (c = 0; def && c < 0x10000; c++) {
+			if (fonts->glyphs[style][c / 8] & (1 << c % 8)) {
+				HPDF_TTFontDef_GetCharWidth(def, c);
 			}
 		}
-		if (*next == 0)
-			break;
-		last_category = category;
-		next++;
 	}
 	return STATUS_OK;
 }
 
-// padding ensures that the specified space exists on the page
+static size_t
+width_cache_slot(struct width_cache *cache, uint32_t codepoint)
+{
+	size_t mask = cache->size - 1;
+	size_t i = (codepoint * 2654435761u) & mask;
+
+	while (cache->keys[i] != 0 && cache->keys[i] != codepoint + 1) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
 static int
-add_page_if_needed(struct render_state *state, float padding)
+width_cache_grow(struct width_cache *cache)
 {
-	if (!state->page ||
-	    state->y - padding <
-	    HPDF_Page_GetHeight(state->page) - TEXT_HEIGHT) {
-		/* add a new page object. */
-		state->page = HPDF_AddPage (state->pdf);
-		if (!state->page) {
-			err("Could not add page");
+	struct width_cache old = *cache;
+	size_t i, j;
+
+	cache->size = old.size ? old.size * 2 : 64;
+	cache->keys = (uint32_t*)calloc(cache->size, sizeof(uint32_t));
+	cache->values = (float*)malloc(cache->size * sizeof(float));
+	if (cache->keys == NULL || cache->values == NULL) {
+		free(cache->keys);
+		free(cache->values);
+		*cache = old;
+		return STATUS_ERR;
+	}
+	for (i = 0; i < old.size; i++) {
+		if (old.keys[i] != 0) {
+			j = width_cache_slot(cache, old.keys[i] - 1);
+			cache->keys[j] = old.keys[i];
+			cache->values[j] = old.values[i];
 		}
-		state->y = HPDF_Page_GetHeight(state->page) - MARGIN_TOP;
-		state->x = MARGIN_LEFT + state->indent;
-		state->last_text_y = state->y;
-		HPDF_Page_SetFontAndSize (state->page,
-					  state->fonts[0],
-					  state->current_font_size);
 	}
+	free(old.keys);
+	free(old.values);
 	return STATUS_OK;
 }
 
+// Decode one UTF-8 character from s (at most len bytes).  Returns the
+// number of bytes used, or 0 if the sequence is malformed.
 static int
-render_box(struct render_state *state, box * b)
+utf8_decode(const unsigned char *s, int len, uint32_t *codepoint)
 {
-	int status;
-	HPDF_Font font;
-	HPDF_Rect rect = {state->x, state->y, state->x + b->width,
-                           state->y + state->current_font_size};
-
-	status = add_page_if_needed(state, 0);
-	if (status == STATUS_ERR) {
-		return status;
+	int n, i;
+	uint32_t c = s[0];
+
+	if (c < 0x80) {
+		*codepoint = c;
+		return 1;
+	} else if ((c & 0xE0) == 0xC0) {
+		n = 2;
+		c &= 0x1F;
+	} else if ((c & 0xF0) == 0xE0) {
+		n = 3;
+		c &= 0x0F;
+	} else if ((c & 0xF8) == 0xF0) {
+		n = 4;
+		c &= 0x07;
+	} else {
+		return 0;
 	}
-
-	if (b->type == IMAGE) {
-		if (HPDF_Page_DrawImage(state->page, b->image,
-					state->x,
-					state->y,
-					//	state->y + state->current_font_size + state->leading - b->height,
-					b->width,
-					b->height
-			    ) != HPDF_OK) {
-			err("Could not draw image");
+	if (n > len) {
+		return 0;
+	}
+	for (i = 1; i < n; i++) {
+		if ((s[i] & 0xC0) != 0x80) {
+			return 0;
 		}
-		state->x += b->width;
-		return STATUS_OK;
+		c = (c << 6) | (s[i] & 0x3F);
 	}
+	*codepoint = c;
+	return n;
+}
 
-	// lazily load fonts as needed
-	if (load_font(state, b->style) == STATUS_ERR) {
-		return STATUS_ERR;
+// Width of the n bytes at s, which are character c, in 1/1000 em.
+// Layout threads have no fonts, and measure with the font definition
+// instead; if that has not been loaded, or c is not one it can
+// measure, the state is marked unmeasured and -1 returned.
+static float
+measure_chars(struct render_state *state, int style,
+	      const unsigned char *s, int n, uint32_t c)
+{
+	HPDF_FontDef def;
+	float width = -1;
+
+	lock_fonts(state);
+	if (state->fonts[style]) {
+		width = HPDF_Font_TextWidth(state->fonts[style], s, n).width;
+	} else if (state->pool && c <= 0xFFFF &&
+		   (def = state->pool->defs[style]) != NULL) {
+		width = HPDF_TTFontDef_GetCharWidth(def, c);
 	}
-	font = state->fonts[b->style];
+	unlock_fonts(state);
+	if (width < 0) {
+		state->unmeasured = true;
+	}
+	return width;
+}
 
-	if (b->link_dest != NULL && b->link_dest[0] != 0) {
-		if (HPDF_Page_CreateURILinkAnnot (state->page, rect,
-						  b->link_dest) == NULL) {
-			errf("Could not create link to '%s'", b->link_dest);
-		}
+// Get cache ready to hold widths of style, measuring its space.
+// Returns false if it can't be measured.
+static bool
+width_cache_init(struct render_state *state, struct width_cache *cache,
+		 int style)
+{
+	float space;
+	int i;
+
+	if (cache->ready) {
+		return true;
 	}
+	space = measure_chars(state, style, (const unsigned char*)"i", 1,
+			      'i');
+	if (space < 0) {
+		return false;
+	}
+	for (i = 0; i < WIDTH_DENSE_SIZE; i++) {
+		cache->dense[i] = -1;
+	}
+	cache->space = space;
+	cache->ready = true;
+	return true;
+}
 
-	HPDF_Page_SetFontAndSize (state->page, font, state->current_font_size);
-	if (b->type == SPACE) {
-		state->x += b->width;
-	} else {
-		HPDF_Page_BeginText (state->page);
-		if (b->link_dest != NULL) {
-			HPDF_Page_SetCMYKFill(state->page, 1, 0.5, 0, 0.5);
-		}
-		HPDF_Page_MoveTextPos(state->page, state->x, state->y);
-		HPDF_Page_ShowText(state->page, b->text);
-		if (b->link_dest != NULL) {
-			HPDF_Page_SetCMYKFill(state->page, 0, 0, 0, 1);
-		}
-		HPDF_Page_EndText (state->page);
-		state->x += b->width;
+// The cache widths of style are measured into: the font cache's, or
+// the state's own while the font cache is only read.
+static struct width_cache *
+width_cache_own(struct render_state *state, int style)
+{
+	return state->pool ? &state->local_widths[style] :
+		&state->widths[style];
+}
+
+// Width of c, or -1 if it is not in cache.  Does not change the
+// cache.
+static float
+width_cache_find(struct width_cache *cache, uint32_t c)
+{
+	size_t slot;
+
+	if (!cache->ready) {
+		return -1;
+	} else if (c < WIDTH_DENSE_SIZE) {
+		return cache->dense[c];
+	} else if (cache->size == 0) {
+		return -1;
 	}
-	return STATUS_OK;
+	slot = width_cache_slot(cache, c);
+	return cache->keys[slot] ? cache->values[slot] : -1;
 }
 
+// Add the width of c to cache, which must be ready.
 static int
-process_boxes(struct render_state *state, bool wrap)
+width_cache_set(struct width_cache *cache, uint32_t c, float width)
 {
-	box *b;
-	box *tmp;
-	box *last_nonspace;
-	box *stop;
-	float total_width = 0;
-	float extra_space_width;
-	float line_end_space;
-	float max_width = TEXT_WIDTH - state->indent;
-	int numspaces;
-	int numspaces_to_last_nonspace;
-	float max_height = 0;
+	size_t slot;
 
-	while (state->boxes_bottom) {
+	if (c < WIDTH_DENSE_SIZE) {
+		cache->dense[c] = width;
+		return STATUS_OK;
+	}
+	if ((cache->count + 1) * 4 > cache->size * 3 &&
+	    width_cache_grow(cache) == STATUS_ERR) {
+		return STATUS_ERR;
+	}
+	slot = width_cache_slot(cache, c);
+	if (cache->keys[slot] == 0) {
+		cache->keys[slot] = c + 1;
+		cache->count++;
+	}
+	cache->values[slot] = width;
+	return STATUS_OK;
+}
 
-		numspaces = 0;
-		b = state->boxes_bottom;
-		last_nonspace = b;
-		// move forward to last box that can fit in line
-		while (b &&
-		       b->type != BREAK &&
-		       (!wrap || total_width + b->width <= max_width)) {
-			total_width += b->width;
-			if (b->type == SPACE) {
-				numspaces++;
-			} else {
-				last_nonspace = b;
-				numspaces_to_last_nonspace = numspaces;
-			}
-			b = b->next;
-		}
+// Add the widths in from that are not in cache.  Running out of
+// memory only leaves some out.
+static void
+width_cache_merge(struct width_cache *cache, struct width_cache *from)
+{
+	size_t i;
+	uint32_t c;
 
-		// recalculate space widths, unless last line of para or
-		// line ends with hard break.
-		if (b && b->type != BREAK && wrap) {
-			line_end_space = max_width - total_width;
-			extra_space_width = (line_end_space / numspaces_to_last_nonspace);
-		} else { // last line
-			extra_space_width = state->current_font_size / 10;
+	if (!from->ready) {
+		return;
+	}
+	if (!cache->ready) {
+		for (i = 0; i < WIDTH_DENSE_SIZE; i++) {
+			cache->dense[i] = -1;
 		}
-
-		tmp = state->boxes_bottom;
-		if (wrap) {
-			while (tmp && tmp != last_nonspace) {
-				if (tmp->type == SPACE) {
-					tmp->width += extra_space_width;
-				}
-				tmp = tmp->next;
-			}
+		cache->space = from->space;
+		cache->ready = true;
+	}
+	for (c = 0; c < WIDTH_DENSE_SIZE; c++) {
+		if (cache->dense[c] < 0) {
+			cache->dense[c] = from->dense[c];
 		}
+	}
+	for (i = 0; i < from->size; i++) {
+		c = from->keys[i] - 1;
+		if (from->keys[i] != 0 && width_cache_find(cache, c) < 0 &&
+		    width_cache_set(cache, c, from->values[i]) == STATUS_ERR) {
+			return;
+		}
+	}
+}
 
-		// emit line up to last_nonspace;
-
-		// remove and free everything up to last_nonspace,
-		// plus any following spaces. reset boxes_bottom.
-		total_width = 0;
-		stop = last_nonspace->next;
-		while (state->boxes_bottom &&
-		       (state->boxes_bottom != stop)) {
-			if (max_height < state->boxes_bottom->height) {
-				max_height = state->boxes_bottom->height;
-			}
-			if (render_box(state, state->boxes_bottom) == STATUS_ERR) {
-				return STATUS_ERR;
-			}
-			tmp = state->boxes_bottom;
-			state->boxes_bottom = state->boxes_bottom->next;
-			if (tmp->text) {
-				free((char*)tmp->text);
-			}
-			free(tmp);
+// Width of text in 1/1000 em, summed from cached per-character
+// widths.  Returns a negative number on allocation failure.  If a
+// width can't be measured, the state is marked unmeasured and it is
+// left out.
+static float
+text_width(struct render_state *state, int style, const char *text,
+	   int len)
+{
+	struct width_cache * shared = &state->widths[style];
+	struct width_cache * cache = width_cache_own(state, style);
+	const unsigned char * s = (const unsigned char *)text;
+	float total = 0;
+	float width;
+	uint32_t c;
+	int i = 0;
+	int n;
+
+	while (i < len) {
+		n = utf8_decode(s + i, len - i, &c);
+		if (n == 0) {
+			// not UTF-8: let libharu measure the rest as is
+			width = measure_chars(state, style, s + i, len - i,
+					      UINT32_MAX);
+			return width < 0 ? total : total + width;
 		}
-		//gobble spaces
-		while (state->boxes_bottom && state->boxes_bottom->type == SPACE) {
-			tmp = state->boxes_bottom;
-			state->boxes_bottom = state->boxes_bottom->next;
-			if (tmp->text) {
-				free((char*)tmp->text);
-			}
-			free(tmp);
+		width = width_cache_find(shared, c);
+		if (width < 0 && cache != shared) {
+			width = width_cache_find(cache, c);
 		}
-		//gobble at most one BREAK
-		if (state->boxes_bottom && state->boxes_bottom->type == BREAK) {
-			tmp = state->boxes_bottom;
-			state->boxes_bottom = state->boxes_bottom->next;
-			if (tmp->text) {
-				free((char*)tmp->text);
+		if (width < 0 && width_cache_init(state, cache, style)) {
+			width = measure_chars(state, style, s + i, n, c);
+			if (width >= 0 &&
+			    width_cache_set(cache, c, width) == STATUS_ERR) {
+				return -1;
 			}
-			free(tmp);
 		}
+		if (width >= 0) {
+			total += width;
+		}
+		i += n;
+	}
+	return total;
+}
 
-		state->last_text_y = state->y;
-		state->x = MARGIN_LEFT + state->indent;
-		state->y -= max_height;
+// Append a box, returning its index, or -1 if out of memory.
+static long
+new_box(struct render_state *state, enum box_type type)
+{
+	struct box_buffer * boxes = &state->boxes;
+	size_t i;
 
+	if (boxes->count == boxes->size &&
+	    box_buffer_grow(boxes) == STATUS_ERR) {
+		return -1;
 	}
-	state->boxes_top = NULL;
-	state->boxes_bottom = NULL;
-	return STATUS_OK;
+	i = boxes->count++;
+	boxes->types[i] = type;
+	boxes->styles[i] = 0;
+	boxes->texts[i] = NULL;
+	boxes->lens[i] = 0;
+	boxes->link_dests[i] = NULL;
+	return i;
 }
 
+static int flush_lines(struct render_state *state, bool wrap, bool final);
+static bool streaming(struct render_state *state);
+
+// path is not copied, like the text of other boxes.
 static int
-parbreak(struct render_state *state, float padding)
+push_image_box(struct render_state *state,
+	       const char *path, float width, float height)
 {
-	int status;
+	long i = new_box(state, IMAGE);
 
-	status = add_page_if_needed(state, padding);
-	if (status == STATUS_ERR) {
-		return status;
+	if (i < 0) {
+		err("Could not allocate box");
+	}
+	state->boxes.texts[i] = path;
+	state->boxes.lens[i] = strlen(path);
+	state->boxes.widths[i] = width;
+	state->boxes.heights[i] = height;
+	if (streaming(state)) {
+		return flush_lines(state, state->wrap, false);
+	}
+	return STATUS_OK;
+}
+
+// Note that the block uses style, so that placing it can load the
+// fonts in the order laying it out did.
+static void
+layout_font(struct block_layout *block, int style)
+{
+	int i;
+
+	for (i = 0; i < block->numfonts; i++) {
+		if (block->fonts[i] == style) {
+			return;
+		}
+	}
+	block->fonts[block->numfonts++] = style;
+}
+
+// text is not copied: it must stay alive until the box is emitted.
+static int
+push_box(struct render_state *state,
+	 enum box_type type,
+	 const char * text,
+	 int len,
+	 int style)
+{
+	struct width_cache * cache;
+	float width;
+
+	if (load_font(state, style) == STATUS_ERR) {
+		return STATUS_ERR;
 	}
-	state->y = state->last_text_y -
-		(1.5 * (state->current_font_size + state->leading));
-	state->x = MARGIN_LEFT + state->indent;
+	layout_font(&state->layout, style);
 
+	long i = new_box(state, type);
+	if (i < 0) {
+		err("Could not allocate box");
+	}
+	state->boxes.styles[i] = style;
+	state->boxes.texts[i] = text;
+	state->boxes.lens[i] = len;
+	state->boxes.link_dests[i] = state->link_dest;
+	state->boxes.heights[i] = state->current_font_size + state->leading;
+
+	if (type == SPACE) {
+		cache = state->widths[style].ready ? &state->widths[style] :
+			width_cache_own(state, style);
+		width = width_cache_init(state, cache, style) ?
+			cache->space : 0;
+		if (!(style & MONOSPACE)) {
+			width *= 0.67;
+		}
+	} else {
+		width = text_width(state, style, text, len);
+		if (width < 0) {
+			err("Could not allocate width cache");
+		}
+	}
+	state->boxes.widths[i] = ( width * state->current_font_size ) / 1000;
+	if (streaming(state)) {
+		return flush_lines(state, state->wrap, false);
+	}
 	return STATUS_OK;
 }
 
 static int
-S_render_node(cmark_node *node, cmark_event_type ev_type,
-              struct render_state *state, int options)
+render_text(struct render_state *state, const char *text, bool wrap, int style)
 {
+	const char * tok = text;
+	const char * end = text + strlen(text);
+	const char * next;
 	int status;
-	int entering = ev_type == CMARK_EVENT_ENTER;
-	float real_width;
-	char * bullets[] = {"\xE2\x97\xA6",
-			    "\xE2\x80\xA2"};
-	char marker[20];
-	size_t len;
-	cmark_node * parent;
-	int itemnumber;
-	cmark_node * tmp;
+
+	while (tok < end) {
+		// tokens are runs of spaces, of newlines, or of other bytes
+		next = scan_token_end(tok, end);
+		status = push_box(state, tok[0] == ' ' ?
+			      SPACE : (tok[0] == '\n' ?
+				       BREAK : TEXT),
+				  tok, next - tok,
+				  style);
+		if (status == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		tok = next;
+	}
+	return STATUS_OK;
+}
+
+static void
+block_layout_clear(struct block_layout *block)
+{
+	block->count = 0;
+	block->numboxes = 0;
+	block->text_len = 0;
+	block->link_src = NULL;
+	block->link = -1;
+	block->numfonts = 0;
+}
+
+static void
+block_layout_free(struct block_layout *block)
+{
+	free(block->items);
+	free(block->boxes);
+	free(block->text);
+	memset(block, 0, sizeof(*block));
+}
+
+// Copy text into the block, followed by a 0.  Returns its offset, or
+// -1 if out of memory.
+static long
+layout_text(struct block_layout *block, const char *text, size_t len)
+{
+	char * p;
+	size_t size;
+	size_t offset = block->text_len;
+
+	if (block->text_len + len + 1 > block->text_size) {
+		size = block->text_size ? block->text_size : 1024;
+		while (size < block->text_len + len + 1) {
+			size *= 2;
+		}
+		p = (char*)realloc(block->text, size);
+		if (p == NULL) {
+			return -1;
+		}
+		block->text = p;
+		block->text_size = size;
+	}
+	memcpy(block->text + offset, text, len);
+	block->text[offset + len] = 0;
+	block->text_len += len + 1;
+	return offset;
+}
+
+// Append an item at the current font size and indent, or return
+// NULL if out of memory.
+static struct layout_item *
+layout_item(struct render_state *state, enum layout_op op, float value)
+{
+	struct block_layout * block = &state->layout;
+	struct layout_item * item;
+	size_t size;
+
+	if (block->count == block->size) {
+		size = block->size ? block->size * 2 : 64;
+		item = (struct layout_item*)realloc(block->items,
+						    size * sizeof(*item));
+		if (item == NULL) {
+			return NULL;
+		}
+		block->items = item;
+		block->size = size;
+	}
+	item = &block->items[block->count++];
+	memset(item, 0, sizeof(*item));
+	item->op = op;
+	item->font_size = state->current_font_size;
+	item->indent = state->indent;
+	item->value = value;
+	return item;
+}
+
+static int place_items(struct render_state *state,
+		       struct block_layout *block);
+
+// Copy boxes start..end-1 into the block as a line height high.  Their
+// text is only copied if the layout is to be kept; otherwise it is
+// still in the document, and the line may be placed straight away.
+static int
+layout_line(struct render_state *state, size_t start, size_t end,
+	    float height)
+{
+	struct box_buffer * boxes = &state->boxes;
+	struct block_layout * block = &state->layout;
+	struct layout_item * item;
+	struct laid_box * box;
+	size_t size;
+	size_t i;
+	long offset;
+
+	if (block->numboxes + (end - start) > block->boxes_size) {
+		size = block->boxes_size ? block->boxes_size : 256;
+		while (size < block->numboxes + (end - start)) {
+			size *= 2;
+		}
+		box = (struct laid_box*)realloc(block->boxes,
+						size * sizeof(*box));
+		if (box == NULL) {
+			err("Could not allocate line");
+		}
+		block->boxes = box;
+		block->boxes_size = size;
+	}
+
+	item = layout_item(state, OP_LINE, height);
+	if (item == NULL) {
+		err("Could not allocate line");
+	}
+	item->start = block->numboxes;
+	for (i = start; i < end; i++) {
+		box = &block->boxes[block->numboxes++];
+		box->type = boxes->types[i];
+		box->style = boxes->styles[i];
+		box->width = boxes->widths[i];
+		box->height = boxes->heights[i];
+		box->len = boxes->lens[i];
+		box->text = 0;
+		box->src = NULL;
+		box->link = -1;
+		if (boxes->texts[i] != NULL && !state->copy_text) {
+			box->src = boxes->texts[i];
+		} else if (boxes->texts[i] != NULL) {
+			offset = layout_text(block, boxes->texts[i],
+					     boxes->lens[i]);
+			if (offset < 0) {
+				err("Could not allocate line");
+			}
+			box->text = offset;
+		}
+		// boxes in one link share its copy, so that placing the
+		// line can tell where the link ends
+		if (boxes->link_dests[i] != NULL) {
+			if (boxes->link_dests[i] != block->link_src) {
+				block->link = layout_text(block,
+					boxes->link_dests[i],
+					strlen(boxes->link_dests[i]));
+				if (block->link < 0) {
+					err("Could not allocate line");
+				}
+				block->link_src = boxes->link_dests[i];
+			}
+			box->link = block->link;
+		}
+	}
+	item->end = block->numboxes;
+
+	// so that only a line of a long block is ever laid out at once
+	if (state->place_lines) {
+		if (place_items(state, block) == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		block_layout_clear(block);
+	}
+	return STATUS_OK;
+}
+
+static const char *
+box_text(struct block_layout *block, struct laid_box *box)
+{
+	return box->src ? box->src : block->text + box->text;
+}
+
+// Select the font for style at the current size, unless the page
+// already uses it.
+static int
+set_font(struct render_state *state, int style)
+{
+	// lazily load fonts as needed
+	if (load_font(state, style) == STATUS_ERR) {
+		return STATUS_ERR;
+	}
+	if (state->page_font != state->fonts[style] ||
+	    state->page_font_size != state->font_size) {
+		HPDF_Page_SetFontAndSize (state->page, state->fonts[style],
+					  state->font_size);
+		state->page_font = state->fonts[style];
+		state->page_font_size = state->font_size;
+	}
+	return STATUS_OK;
+}
+
+// padding ensures that the specified space exists on the page
+static int
+add_page_if_needed(struct render_state *state, float padding)
+{
+	if (state->pages == 0 ||
+	    state->y - padding < state->page_height - TEXT_HEIGHT) {
+		/* add a new page object. */
+		if (!state->pagination) {
+			state->page = HPDF_AddPage (state->pdf);
+			if (!state->page) {
+				err("Could not add page");
+			}
+			state->page_height = HPDF_Page_GetHeight(state->page);
+		}
+		state->pages++;
+		state->y = state->page_height - MARGIN_TOP;
+		state->last_text_y = state->y;
+		state->page_font = NULL;
+		if (!state->pagination && set_font(state, 0) == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+	}
+	return STATUS_OK;
+}
+
+// Append to the text run collected in text_buf.
+static int
+append_text(struct render_state *state, const char *text, size_t len)
+{
+	char * buf;
+	size_t size;
+
+	if (state->text_buf_size < state->text_len + len + 1) {
+		size = state->text_buf_size ? state->text_buf_size : 256;
+		while (size < state->text_len + len + 1) {
+			size *= 2;
+		}
+		buf = (char*)realloc(state->text_buf, size);
+		if (buf == NULL) {
+			err("Could not allocate text buffer");
+		}
+		state->text_buf = buf;
+		state->text_buf_size = size;
+	}
+	memcpy(state->text_buf + state->text_len, text, len);
+	state->text_len += len;
+	return STATUS_OK;
+}
+
+// Show the collected text run, if any.
+static void
+flush_text(struct render_state *state)
+{
+	if (state->text_len > 0) {
+		state->text_buf[state->text_len] = 0;
+		// showing text marks its characters in the font
+		lock_fonts(state);
+		HPDF_Page_ShowText(state->page, state->text_buf);
+		unlock_fonts(state);
+		state->text_len = 0;
+	}
+}
+
+static int
+add_link(struct render_state *state, const char *link_dest,
+	 float left, float right)
+{
+	HPDF_Rect rect = {left, state->y, right,
+			  state->y + state->font_size};
+
+	if (link_dest != NULL && link_dest[0] != 0) {
+		if (HPDF_Page_CreateURILinkAnnot (state->page, rect,
+						  link_dest) == NULL) {
+			errf("Could not create link to '%s'", link_dest);
+		}
+	}
+	return STATUS_OK;
+}
+
+// Draw a laid-out line at state->y.  Text goes in a single text
+// object; adjacent text is shown as one string, and the text
+// position only moves across justified spaces.  (The UTF-8 fonts are
+// composite fonts with two-byte codes, to which the word spacing
+// operator does not apply, so spaces can't be stretched with Tw.)
+// Font and fill color are only set when they change.
+static int
+render_line(struct render_state *state, struct block_layout *block,
+	    struct layout_item *line)
+{
+	struct laid_box * box;
+	size_t i;
+	int style;
+	float width;
+	float space_width;
+	float line_x = 0;  // start of the current text line, if in text
+	float pen_x = 0;   // where the next shown glyph will go
+	bool in_text = false;
+	bool link_color = false;
+	long link = -1;
+	float link_x = 0;
+	const char * path;
+	long id;
+	float image_width, image_height;
 	HPDF_Image image;
-	const char * image_path;
 
-	switch (cmark_node_get_type(node)) {
-	case CMARK_NODE_DOCUMENT:
-		break;
+	if (add_page_if_needed(state, 0) == STATUS_ERR) {
+		return STATUS_ERR;
+	}
+	state->x = MARGIN_LEFT + line->indent;
+
+	for (i = line->start; i < line->end; i++) {
+		box = &block->boxes[i];
+		width = box->width;
+		style = box->style;
+
+		// one annotation per run of boxes with the same link
+		if (box->link != link || box->type == IMAGE) {
+			if (add_link(state,
+				     link < 0 ? NULL : block->text + link,
+				     link_x, state->x) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			link = box->type == IMAGE ? -1 : box->link;
+			link_x = state->x;
+		}
 
-	case CMARK_NODE_ITEM:
-		parent = cmark_node_parent(node);
-		real_width = state->current_font_size *
-			(cmark_node_get_list_type(parent) == CMARK_BULLET_LIST ?
-			 1.5 : 3);
-		if (entering) {
-			if (cmark_node_get_list_type(parent) == CMARK_BULLET_LIST) {
-				parbreak(state, 0);
-				len = strlen(bullets[state->list_indent_level % 2]);
-				memcpy(marker, bullets[state->list_indent_level % 2], len);
-				marker[len] = 0;
-			} else {
-				itemnumber = cmark_node_get_list_start(parent);
-				tmp = node;
-				while (cmark_node_previous(tmp)) {
-					itemnumber++;
-					tmp = cmark_node_previous(tmp);
+		if (box->type == IMAGE) {
+			if (in_text) {
+				flush_text(state);
+				HPDF_Page_EndText (state->page);
+				in_text = false;
+			}
+			// the image is only read now that it is needed
+			path = box_text(block, box);
+			id = image_cache_probe(&state->images, path,
+					       TEXT_WIDTH - line->indent,
+					       state->config.image_dpi,
+					       &image_width, &image_height);
+			image = id < 0 ? NULL :
+				image_cache_image(&state->images, state->pdf, id);
+			if (image == NULL) {
+				fprintf(stderr, "Could not load image '%s'\n",
+					path);
+				HPDF_ResetError(state->pdf);
+			} else if (HPDF_Page_DrawImage(state->page, image,
+						state->x,
+						state->y,
+						//	state->y + state->current_font_size + state->leading - box->height,
+						width,
+						box->height
+				    ) != HPDF_OK) {
+				err("Could not draw image");
+			}
+			state->x += width;
+			continue;
+		}
+
+		if (box->type == SPACE) {
+			// a space of natural width can be shown as part of
+			// the run; otherwise the next text is moved into place
+			if (in_text && state->text_len > 0 &&
+			    state->fonts[style] == state->page_font &&
+			    (box->link >= 0) == link_color) {
+				space_width = (text_width(state, style, " ", 1) *
+					       state->font_size) / 1000;
+				if (fabsf(space_width - width) < 0.01) {
+					if (append_text(state, " ", 1) ==
+					    STATUS_ERR) {
+						return STATUS_ERR;
+					}
+					pen_x += width;
 				}
-				sprintf(marker, "%4d.", itemnumber);
-				len = strlen(marker);
 			}
-			parbreak(state, 0);
-			HPDF_Page_SetFontAndSize (state->page,
-						  state->fonts[0],
-						  state->current_font_size);
+			state->x += width;
+			continue;
+		}
+
+		if (state->fonts[style] != state->page_font ||
+		    (box->link >= 0) != link_color) {
+			flush_text(state);
+		}
+		if (!in_text) {
 			HPDF_Page_BeginText (state->page);
 			HPDF_Page_MoveTextPos(state->page, state->x, state->y);
-			HPDF_Page_ShowText(state->page, marker);
+			line_x = pen_x = state->x;
+			in_text = true;
+		} else if (fabsf(pen_x - state->x) >= 0.01) {
+			flush_text(state);
+			HPDF_Page_MoveTextPos(state->page, state->x - line_x, 0);
+			line_x = pen_x = state->x;
+		}
+		if (set_font(state, style) == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		if ((box->link >= 0) != link_color) {
+			link_color = !link_color;
+			if (link_color) {
+				HPDF_Page_SetCMYKFill(state->page, 1, 0.5, 0, 0.5);
+			} else {
+				HPDF_Page_SetCMYKFill(state->page, 0, 0, 0, 1);
+			}
+		}
+		if (append_text(state, box_text(block, box),
+				box->len) == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		pen_x += width;
+		state->x += width;
+	}
+
+	if (add_link(state, link < 0 ? NULL : block->text + link,
+		     link_x, state->x) == STATUS_ERR) {
+		return STATUS_ERR;
+	}
+	if (in_text) {
+		flush_text(state);
+		HPDF_Page_EndText (state->page);
+	}
+	if (link_color) {
+		HPDF_Page_SetCMYKFill(state->page, 0, 0, 0, 1);
+	}
+	return STATUS_OK;
+}
+
+// Add where the top-level block being placed starts, once it has
+// something to draw.
+static int
+add_position(struct render_state *state)
+{
+	cmark_pdf_pagination * pagination = state->pagination;
+	cmark_pdf_block_position * blocks;
+	size_t size;
+
+	if (pagination == NULL || state->block == NULL) {
+		return STATUS_OK;
+	}
+	if (pagination->count == state->positions_size) {
+		size = state->positions_size ? state->positions_size * 2 : 64;
+		blocks = (cmark_pdf_block_position*)realloc(pagination->blocks,
+						size * sizeof(*blocks));
+		if (blocks == NULL) {
+			err("Could not allocate block positions");
+		}
+		pagination->blocks = blocks;
+		state->positions_size = size;
+	}
+	blocks = &pagination->blocks[pagination->count++];
+	blocks->node = state->block;
+	blocks->page = state->pages;
+	blocks->y = state->y;
+	state->block = NULL;
+	return STATUS_OK;
+}
+
+// Place a block's items on pages, below what was placed before.
+// When paginating, nothing is drawn.
+static int
+place_items(struct render_state *state, struct block_layout *block)
+{
+	struct layout_item * item;
+	size_t i;
+	float x;
+
+	// libharu numbers fonts in the order they are loaded, so a block
+	// laid out elsewhere loads its fonts here as laying it out would
+	for (i = 0; i < (size_t)block->numfonts; i++) {
+		if (load_font(state, block->fonts[i]) == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+	}
+
+	for (i = 0; i < block->count; i++) {
+		item = &block->items[i];
+		state->font_size = item->font_size;
+
+		switch (item->op) {
+		case OP_PARBREAK:
+			if (add_page_if_needed(state, item->padding) ==
+			    STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			state->y = state->last_text_y - item->value;
+			break;
+
+		case OP_LINE:
+			if (state->pagination) {
+				if (add_page_if_needed(state, 0) == STATUS_ERR) {
+					return STATUS_ERR;
+				}
+			} else if (render_line(state, block, item) ==
+				   STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			if (add_position(state) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			state->last_text_y = state->y;
+			state->y -= item->value;
+			break;
+
+		case OP_MARKER:
+			if (add_position(state) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			if (state->pagination) {
+				break;
+			}
+			if (set_font(state, 0) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			HPDF_Page_BeginText (state->page);
+			HPDF_Page_MoveTextPos(state->page,
+					      MARGIN_LEFT + item->indent,
+					      state->y);
+			lock_fonts(state);
+			HPDF_Page_ShowText(state->page,
+					   block->text + item->start);
+			unlock_fonts(state);
 			HPDF_Page_EndText (state->page);
-			state->x += real_width;
-			state->indent += real_width;
-		} else {
-			state->indent -= real_width;
+			break;
+
+		case OP_HRULE:
+			if (add_position(state) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			if (!state->pagination) {
+				x = MARGIN_LEFT + item->indent;
+				HPDF_Page_MoveTo(state->page, x, state->y + state->leading);
+				HPDF_Page_LineTo(state->page, x + (TEXT_WIDTH - item->indent), state->y + state->leading);
+				HPDF_Page_Stroke(state->page);
+			}
+			state->last_text_y = state->y;
+			state->y -= item->value;
+			break;
+
+		case OP_SKIP:
+			state->y -= item->value;
+			break;
 		}
-		break;
+	}
+	return STATUS_OK;
+}
+
+// Lay out boxes start..end-1 as a line, adding extra_space_width to
+// each space if wrapping.
+static int
+emit_line(struct render_state *state, size_t start, size_t end,
+	  float extra_space_width, bool wrap)
+{
+	struct box_buffer * boxes = &state->boxes;
+	size_t i;
+
+	if (wrap) {
+		for (i = start; i + 1 < end; i++) {
+			if (boxes->types[i] == SPACE) {
+				boxes->widths[i] += extra_space_width;
+			}
+		}
+	}
+
+	// line height only grows within a block
+	for (i = start; i < end; i++) {
+		if (state->line_height < boxes->heights[i]) {
+			state->line_height = boxes->heights[i];
+		}
+	}
+	return layout_line(state, start, end, state->line_height);
+}
+
+// Knuth-Plass total-fit line breaking.  Lines may break at the first
+// of a run of spaces, and must break at BREAK boxes and at the end.
+// A space stretches by half and shrinks by a third of its natural
+// width, which is its box width plus the font size / 10 that the
+// greedy breaker gives spaces on unjustified lines.  The last line
+// and lines ending in a hard break are set at natural width.
+//
+// To keep the worst case near linear, at most KP_MAX_ACTIVE
+// breakpoints are active at once: when there are more, the one with
+// the most demerits is dropped.  If no feasible break exists, the
+// line is broken where the greedy breaker would have broken it.
+#define KP_MAX_ACTIVE 32
+#define KP_TOLERANCE 2.0   // largest stretch ratio allowed
+#define KP_LINE_PENALTY 10
+
+struct kp_node {
+	size_t pos;        // box where the break happens (count at end)
+	size_t next_start; // first box of the following line
+	long prev;         // previous node, -1 for the start
+	double demerits;
+	bool forced;
+};
+
+struct kp_sums {
+	double width;      // all boxes, spaces at their box width
+	double spaces;     // space boxes only
+	size_t numspaces;
+};
+
+// Cost of a line from node n ending before box end, or -1 if the
+// line is too loose.  Sets *overfull if it can't be shrunk to fit.
+static double
+kp_line_demerits(struct kp_node *nodes, long n, struct kp_sums *sums,
+		 size_t end, bool forced, double space_extra,
+		 float max_width, bool *overfull)
+{
+	size_t start = nodes[n].next_start;
+	size_t numspaces;
+	double natural, stretch, shrink, ratio, badness;
+
+	if (end < start) {
+		end = start;
+	}
+	numspaces = sums[end].numspaces - sums[start].numspaces;
+	natural = sums[end].width - sums[start].width +
+		numspaces * space_extra;
+	stretch = (sums[end].spaces - sums[start].spaces +
+		   numspaces * space_extra) / 2;
+	shrink = stretch * 2 / 3;
+
+	if (natural > max_width) {
+		ratio = shrink > 0 ? (max_width - natural) / shrink : -HUGE_VAL;
+	} else if (forced) {
+		ratio = 0;
+	} else {
+		ratio = stretch > 0 ? (max_width - natural) / stretch : HUGE_VAL;
+	}
+	*overfull = ratio < -1;
+	if (*overfull || ratio > KP_TOLERANCE) {
+		return -1;
+	}
+	badness = 100 * fabs(ratio * ratio * ratio);
+	return nodes[n].demerits +
+		(KP_LINE_PENALTY + badness) * (KP_LINE_PENALTY + badness);
+}
+
+static int
+process_boxes_optimal(struct render_state *state)
+{
+	struct box_buffer * boxes = &state->boxes;
+	const unsigned char * types = boxes->types;
+	size_t count = boxes->count;
+	float max_width = TEXT_WIDTH - state->indent;
+	double space_extra = state->current_font_size / 10;
+	struct kp_sums * sums = NULL;
+	struct kp_node * nodes = NULL;
+	struct kp_node * grown;
+	size_t * lines = NULL;
+	long active[KP_MAX_ACTIVE];
+	int numactive = 0;
+	size_t numnodes = 0;
+	size_t nodes_size = count + 2;
+	size_t numlines = 0;
+	size_t i, b, end, start, numspaces;
+	long best, dropped, n;
+	double demerits, best_demerits, width;
+	bool forced, overfull;
+	int k, worst;
+	int status = STATUS_ERR;
+
+	// prefix sums, so that any line's width is a subtraction
+	sums = (struct kp_sums*)malloc((count + 1) * sizeof(*sums));
+	// usually one node per breakpoint at most, but breaking where
+	// nothing is feasible goes back and can add more, so this grows
+	nodes = (struct kp_node*)malloc(nodes_size * sizeof(*nodes));
+	if (sums == NULL || nodes == NULL) {
+		fprintf(stderr, "ERROR (%s:%d): %s\n", __FILE__, __LINE__,
+			"Could not allocate line breaking tables");
+		goto done;
+	}
+	sums[0].width = sums[0].spaces = 0;
+	sums[0].numspaces = 0;
+	for (i = 0; i < count; i++) {
+		sums[i + 1] = sums[i];
+		sums[i + 1].width += boxes->widths[i];
+		if (types[i] == SPACE) {
+			sums[i + 1].spaces += boxes->widths[i];
+			sums[i + 1].numspaces++;
+		}
+	}
+
+	nodes[0].pos = 0;
+	nodes[0].next_start = 0;
+	nodes[0].prev = -1;
+	nodes[0].demerits = 0;
+	nodes[0].forced = true;
+	numnodes = 1;
+	active[numactive++] = 0;
+
+	for (b = 0; b <= count; b++) {
+		// legal breakpoints: the first of a run of spaces,
+		// unless a hard break or the end follows; hard
+		// breaks; and the end
+		if (b < count && types[b] != BREAK) {
+			if (types[b] != SPACE ||
+			    (b > 0 && types[b - 1] == SPACE)) {
+				continue;
+			}
+			for (i = b; i < count && types[i] == SPACE; i++)
+				;
+			if (i == count || types[i] == BREAK) {
+				continue;
+			}
+		}
+		forced = (b == count || types[b] == BREAK);
+
+		// the line before a break ends at its last non-space box
+		end = b;
+		while (end > 0 && types[end - 1] == SPACE) {
+			end--;
+		}
+
+		best = -1;
+		best_demerits = 0;
+		dropped = -1;
+		for (k = 0; k < numactive; k++) {
+			n = active[k];
+			demerits = kp_line_demerits(nodes, n, sums, end,
+						    forced, space_extra,
+						    max_width, &overfull);
+			if (overfull) {
+				// every later line from n is too long too
+				if (dropped < 0 ||
+				    nodes[n].demerits < nodes[dropped].demerits) {
+					dropped = n;
+				}
+				active[k--] = active[--numactive];
+			} else if (demerits >= 0 &&
+				   (best < 0 || demerits < best_demerits)) {
+				best = n;
+				best_demerits = demerits;
+			}
+		}
+
+		if (best < 0 && numactive == 0) {
+			// nothing feasible: break after the dropped node
+			// where the greedy breaker would, at the last
+			// space that fits, or else here, overfull
+			best = dropped;
+			best_demerits = nodes[dropped].demerits;
+			start = nodes[dropped].next_start;
+			width = 0;
+			for (i = start; i < end; i++) {
+				if (width > max_width) {
+					break;
+				}
+				if (types[i] == SPACE && i > start &&
+				    types[i - 1] != SPACE) {
+					b = i;
+					forced = false;
+				}
+				width += boxes->widths[i];
+			}
+		}
+
+		if (best < 0) {
+			continue;
+		}
+
+		if (numnodes == nodes_size) {
+			grown = (struct kp_node*)realloc(nodes, 2 * nodes_size *
+							 sizeof(*nodes));
+			if (grown == NULL) {
+				fprintf(stderr, "ERROR (%s:%d): %s\n",
+					__FILE__, __LINE__,
+					"Could not allocate line breaking tables");
+				goto done;
+			}
+			nodes = grown;
+			nodes_size *= 2;
+		}
+		nodes[numnodes].pos = b;
+		nodes[numnodes].prev = best;
+		nodes[numnodes].demerits = best_demerits;
+		nodes[numnodes].forced = forced;
+		// the next line starts after the spaces, or after
+		// the hard break
+		if (forced) {
+			i = b < count ? b + 1 : b;
+		} else {
+			for (i = b; i < count && types[i] == SPACE; i++)
+				;
+		}
+		nodes[numnodes].next_start = i;
+
+		if (forced) {
+			// no line can span a forced break
+			numactive = 0;
+		} else if (numactive == KP_MAX_ACTIVE) {
+			worst = 0;
+			for (k = 1; k < numactive; k++) {
+				if (nodes[active[k]].demerits >
+				    nodes[active[worst]].demerits) {
+					worst = k;
+				}
+			}
+			active[worst] = active[--numactive];
+		}
+		active[numactive++] = numnodes;
+		numnodes++;
+	}
+
+	// walk back from the final break to find the lines
+	lines = (size_t*)malloc(numnodes * sizeof(*lines));
+	if (lines == NULL) {
+		fprintf(stderr, "ERROR (%s:%d): %s\n", __FILE__, __LINE__,
+			"Could not allocate line breaking tables");
+		goto done;
+	}
+	for (n = numnodes - 1; n > 0; n = nodes[n].prev) {
+		lines[numlines++] = n;
+	}
+
+	while (numlines > 0) {
+		n = lines[--numlines];
+		start = nodes[nodes[n].prev].next_start;
+		if (start >= count) {
+			break;
+		}
+		end = nodes[n].pos;
+		while (end > start && types[end - 1] == SPACE) {
+			end--;
+		}
+		if (end == start) {
+			// a hard break on its own line, as the greedy
+			// breaker would emit it
+			end = start + 1;
+		}
+		numspaces = sums[end - 1].numspaces - sums[start].numspaces;
+		if (nodes[n].forced || numspaces == 0) {
+			width = space_extra;
+		} else {
+			width = (max_width - (sums[end].width -
+					      sums[start].width)) / numspaces;
+		}
+		if (emit_line(state, start, end, width, true) == STATUS_ERR) {
+			goto done;
+		}
+	}
+	status = STATUS_OK;
+
+done:
+	free(sums);
+	free(nodes);
+	free(lines);
+	boxes->count = 0;
+	return status;
+}
+
+// Greedy line breaking.  Lines are emitted as soon as they are
+// determined, by a hard break or (when wrapping) by a box that
+// doesn't fit, and their boxes are dropped, so only about one line
+// of boxes is ever pending.  If final is set, the block is complete
+// and everything is emitted.
+static int
+flush_lines(struct render_state *state, bool wrap, bool final)
+{
+	struct box_buffer * boxes = &state->boxes;
+	struct line_fit * fit = &state->fit;
+	const unsigned char * types = boxes->types;
+	float * widths = boxes->widths;
+	size_t count = boxes->count;
+	size_t start = 0;
+	size_t b;
+	float extra_space_width;
+	float line_end_space;
+	float max_width = TEXT_WIDTH - state->indent;
+	int status = STATUS_OK;
+
+	while (start < count) {
+
+		if (fit->gobbling) {
+			//gobble spaces
+			if (types[start] == SPACE) {
+				start++;
+				continue;
+			}
+			//gobble at most one BREAK
+			if (types[start] == BREAK) {
+				start++;
+			}
+			fit->gobbling = false;
+			fit->end = start;
+			fit->last_nonspace = start;
+			fit->width = 0;
+			fit->numspaces = 0;
+			continue;
+		}
+
+		// move forward to last box that can fit in line
+		b = fit->end;
+		while (b < count &&
+		       types[b] != BREAK &&
+		       (!wrap || fit->width + widths[b] <= max_width)) {
+			fit->width += widths[b];
+			if (types[b] == SPACE) {
+				fit->numspaces++;
+			} else {
+				fit->last_nonspace = b;
+				fit->numspaces_to_last_nonspace = fit->numspaces;
+			}
+			b++;
+		}
+		fit->end = b;
+
+		if (b == count && !final) {
+			// more boxes may still fit on this line
+			break;
+		}
+
+		// recalculate space widths, unless last line of para or
+		// line ends with hard break.
+		if (b < count && types[b] != BREAK && wrap) {
+			line_end_space = max_width - fit->width;
+			extra_space_width = (line_end_space /
+					     fit->numspaces_to_last_nonspace);
+		} else { // last line
+			extra_space_width = state->current_font_size / 10;
+		}
+
+		// emit line up to last_nonspace, then skip any
+		// following spaces.
+		status = emit_line(state, start, fit->last_nonspace + 1,
+				   extra_space_width, wrap);
+		if (status == STATUS_ERR) {
+			break;
+		}
+		start = fit->last_nonspace + 1;
+		fit->gobbling = true;
+	}
+
+	if (final || status == STATUS_ERR) {
+		boxes->count = 0;
+		memset(fit, 0, sizeof(*fit));
+	} else if (start > 0) {
+		box_buffer_shift(boxes, start);
+		fit->end -= start;
+		fit->last_nonspace -= start;
+	}
+	return status;
+}
+
+// Whether lines are emitted while boxes are still being pushed.
+// The optimal breaker needs the whole block.
+static bool
+streaming(struct render_state *state)
+{
+	return !(state->wrap &&
+		 (state->options & CMARK_PDF_OPT_OPTIMAL_BREAKS));
+}
+
+// Emit whatever is left of the current block.
+static int
+process_boxes(struct render_state *state, bool wrap)
+{
+	int status;
+
+	if (wrap && (state->options & CMARK_PDF_OPT_OPTIMAL_BREAKS)) {
+		status = process_boxes_optimal(state);
+	} else {
+		status = flush_lines(state, wrap, true);
+	}
+	state->line_height = 0;
+	return status;
+}
+
+// padding ensures that the specified space exists on the page
+static int
+parbreak(struct render_state *state, float padding)
+{
+	struct layout_item * item;
+
+	item = layout_item(state, OP_PARBREAK,
+			   1.5 * (state->current_font_size + state->leading));
+	if (item == NULL) {
+		err("Could not allocate layout");
+	}
+	item->padding = padding;
+	return STATUS_OK;
+}
+
+// Add an item that only moves down, or draws.
+static int
+layout_op(struct render_state *state, enum layout_op op, float value)
+{
+	if (layout_item(state, op, value) == NULL) {
+		err("Could not allocate layout");
+	}
+	return STATUS_OK;
+}
+
+static int
+S_render_node(cmark_node *node, cmark_event_type ev_type,
+              struct render_state *state, int options)
+{
+	int status;
+	int entering = ev_type == CMARK_EVENT_ENTER;
+	float real_width;
+	char * bullets[] = {"\xE2\x97\xA6",
+			    "\xE2\x80\xA2"};
+	char marker[20];
+	size_t len;
+	cmark_node * parent;
+	int itemnumber;
+	int * numbers;
+	long image;
+	struct layout_item * item;
+	long offset;
+	const char * image_path;
+	float image_width, image_height;
+
+	switch (cmark_node_get_type(node)) {
+	case CMARK_NODE_DOCUMENT:
+		break;
+
+	case CMARK_NODE_ITEM:
+		parent = cmark_node_parent(node);
+		real_width = state->current_font_size *
+			(cmark_node_get_list_type(parent) == CMARK_BULLET_LIST ?
+			 1.5 : 3);
+		if (entering) {
+			if (cmark_node_get_list_type(parent) == CMARK_BULLET_LIST) {
+				parbreak(state, 0);
+				len = strlen(bullets[state->list_indent_level % 2]);
+				memcpy(marker, bullets[state->list_indent_level % 2], len);
+				marker[len] = 0;
+			} else {
+				itemnumber = state->item_numbers[state->list_indent_level - 1]++;
+				sprintf(marker, "%4d.", itemnumber);
+				len = strlen(marker);
+			}
+			parbreak(state, 0);
+			item = layout_item(state, OP_MARKER, 0);
+			if (item == NULL ||
+			    (offset = layout_text(&state->layout, marker,
+						  len)) < 0) {
+				err("Could not allocate layout");
+			}
+			item->start = offset;
+			state->indent += real_width;
+		} else {
+			state->indent -= real_width;
+		}
+		break;
+
+	case CMARK_NODE_LIST:
+		if (entering) {
+			if (state->list_indent_level == state->item_numbers_size) {
+				len = state->item_numbers_size ?
+					state->item_numbers_size * 2 : 8;
+				numbers = (int*)realloc(state->item_numbers,
+							len * sizeof(int));
+				if (numbers == NULL) {
+					err("Could not allocate list numbers");
+				}
+				state->item_numbers = numbers;
+				state->item_numbers_size = len;
+			}
+			state->item_numbers[state->list_indent_level] =
+				cmark_node_get_list_start(node);
+			state->list_indent_level++;
+		} else {
+			state->list_indent_level--;
+		}
+		break;
+
+	case CMARK_NODE_HRULE:
+		parbreak(state, 0);
+		return layout_op(state, OP_HRULE,
+				 state->current_font_size + state->leading);
+
+	case CMARK_NODE_BLOCK_QUOTE:
+		if (entering) {
+			state->indent += state->base_font_size * 2;
+			state->current_font_size = state->base_font_size - 2;
+		} else {
+			state->current_font_size = state->base_font_size;
+			state->indent -= state->base_font_size * 2;
+		}
+		break;
+
+	case CMARK_NODE_PARAGRAPH:
+		if (entering) {
+			state->wrap = true;
+			if (parbreak(state, 0) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+		} else {
+			if (process_boxes(state, true) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+		}
+		break;
+
+	case CMARK_NODE_CODE_BLOCK:
+		parbreak(state, 0);
+		state->wrap = false;
+		status = render_text(state, cmark_node_get_literal(node), false, state->style | MONOSPACE);
+		if (status == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		status = process_boxes(state, false);
+		if (status == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		return layout_op(state, OP_SKIP,
+				 state->current_font_size + state->leading);
+
+	case CMARK_NODE_HEADER:
+		if (entering) {
+			int lev = cmark_node_get_header_level(node);
+			state->current_font_size = state->base_font_size * (1.66 - (lev/6));
+			parbreak(state, 3 * state->current_font_size);
+			state->wrap = true;
+		} else {
+			if (process_boxes(state, true) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			if (layout_op(state, OP_SKIP,
+				      0.3 * (state->current_font_size +
+					     state->leading)) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			state->current_font_size = state->base_font_size;
+		}
+		break;
+
+	case CMARK_NODE_CODE:
+		return render_text(state, cmark_node_get_literal(node), true, state->style | MONOSPACE);
+
+	case CMARK_NODE_SOFTBREAK:
+		return push_box(state, SPACE, NULL, 0, 0);
+
+	case CMARK_NODE_LINEBREAK:
+		return push_box(state, BREAK, NULL, 0, 0);
+
+	case CMARK_NODE_TEXT:
+		return render_text(state, cmark_node_get_literal(node), true, state->style);
+
+	case CMARK_NODE_LINK:
+		if (entering) {
+			state->link_dest = cmark_node_get_url(node);
+		} else {
+			state->link_dest = NULL;
+		}
+		break;
+
+	case CMARK_NODE_IMAGE:
+		if (entering) {
+			image_path = cmark_node_get_url(node);
+			image = image_cache_probe(&state->images, image_path,
+						  TEXT_WIDTH - state->indent,
+						  state->config.image_dpi,
+						  &image_width, &image_height);
+			if (image < 0) {
+				fprintf(stderr,
+					"Could not load image '%s'\n",
+					image_path);
+				if (state->pdf) {
+					HPDF_ResetError(state->pdf);
+				}
+				return STATUS_OK;
+			} else if (push_image_box(state, image_path,
+						  image_width,
+						  image_height) == STATUS_ERR) {
+				return STATUS_ERR;
+			}
+			return STATUS_SKIP;
+		}
+		break;
+
+	case CMARK_NODE_EMPH:
+		if (entering) {
+			state->style |= ITALIC;
+		} else {
+			state->style &= ~ITALIC;
+		}
+		break;
+
+	case CMARK_NODE_STRONG:
+		if (entering) {
+			state->style |= BOLD;
+		} else {
+			state->style &= ~BOLD;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return STATUS_OK;
+}
+
+static void
+hash_string(struct sha256 *h, const char *s)
+{
+	if (s == NULL) {
+		s = "";
+	}
+	// include the terminator so that "ab","c" differs from "a","bc"
+	sha256_update(h, s, strlen(s) + 1);
+}
+
+// Hash what identifies the content of the image file at path, so that
+// a block is laid out again when one of its images is replaced.
+static void
+hash_image(struct sha256 *h, const char *path)
+{
+	struct stat st;
+	int64_t id[3] = { -1, -1, -1 };
+
+	hash_string(h, path);
+	if (path && stat(path, &st) == 0) {
+		id[0] = st.st_size;
+		id[1] = st.st_mtime;
+		id[2] = st.st_ino;
+	}
+	sha256_update(h, id, sizeof(id));
+}
+
+// Nodes the iterator enters without exiting.
+static bool
+is_leaf(cmark_node *node)
+{
+	switch (cmark_node_get_type(node)) {
+	case CMARK_NODE_CODE_BLOCK:
+	case CMARK_NODE_HTML:
+	case CMARK_NODE_HRULE:
+	case CMARK_NODE_TEXT:
+	case CMARK_NODE_SOFTBREAK:
+	case CMARK_NODE_LINEBREAK:
+	case CMARK_NODE_CODE:
+	case CMARK_NODE_INLINE_HTML:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Hash everything about a top-level block that its layout depends
+// on, including the files of its images, which are laid out from
+// their headers.
+static void
+block_key(cmark_node *block, int options, const cmark_pdf_config *config,
+	  struct layout_key *key)
+{
+	struct sha256 h;
+	cmark_iter * iter = cmark_iter_new(block);
+	cmark_event_type ev_type;
+	cmark_node * cur;
+	int n;
+
+	sha256_init(&h);
+	sha256_update(&h, &options, sizeof(options));
+	sha256_update(&h, &config->image_dpi, sizeof(config->image_dpi));
+	while ((ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+		cur = cmark_iter_get_node(iter);
+		sha256_update(&h, &ev_type, sizeof(ev_type));
+		if (ev_type != CMARK_EVENT_ENTER) {
+			continue;
+		}
+		n = cmark_node_get_type(cur);
+		sha256_update(&h, &n, sizeof(n));
+		switch (n) {
+		case CMARK_NODE_HEADER:
+			n = cmark_node_get_header_level(cur);
+			sha256_update(&h, &n, sizeof(n));
+			break;
+		case CMARK_NODE_LIST:
+			n = cmark_node_get_list_type(cur);
+			sha256_update(&h, &n, sizeof(n));
+			n = cmark_node_get_list_start(cur);
+			sha256_update(&h, &n, sizeof(n));
+			break;
+		case CMARK_NODE_LINK:
+			hash_string(&h, cmark_node_get_url(cur));
+			break;
+		case CMARK_NODE_IMAGE:
+			hash_image(&h, cmark_node_get_url(cur));
+			break;
+		default:
+			if (is_leaf(cur)) {
+				hash_string(&h, cmark_node_get_literal(cur));
+			}
+			break;
+		}
+	}
+	cmark_iter_free(iter);
+	sha256_final(&h, key->digest);
+}
+
+// Where to start looking for key in a table of size entries.
+static size_t
+layout_key_slot(const struct layout_key *key, size_t size)
+{
+	uint64_t h;
+
+	memcpy(&h, key->digest, sizeof(h));
+	return h % size;
+}
+
+// Does not change the cache, so threads can look up at once.
+static struct layout_entry *
+layout_cache_lookup(struct layout_cache *cache, const struct layout_key *key)
+{
+	size_t i;
+
+	if (cache->size == 0) {
+		return NULL;
+	}
+	for (i = layout_key_slot(key, cache->size); cache->entries[i].used;
+	     i = (i + 1) % cache->size) {
+		if (memcmp(cache->entries[i].key.digest, key->digest,
+			   SHA256_SIZE) == 0) {
+			return &cache->entries[i];
+		}
+	}
+	return NULL;
+}
+
+static struct block_layout *
+layout_cache_find(struct layout_cache *cache, const struct layout_key *key)
+{
+	struct layout_entry * entry = layout_cache_lookup(cache, key);
+
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->last_render = cache->render;
+	return &entry->block;
+}
+
+static void
+layout_cache_insert(struct layout_entry *entries, size_t size,
+		    struct layout_entry *entry)
+{
+	size_t i;
+
+	for (i = layout_key_slot(&entry->key, size); entries[i].used;
+	     i = (i + 1) % size)
+		;
+	entries[i] = *entry;
+}
+
+// Rebuild the table without the entries that have gone unused, and
+// with room for need more.
+static int
+layout_cache_rebuild(struct layout_cache *cache, size_t need)
+{
+	struct layout_entry * entries;
+	size_t size = 64;
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].used &&
+		    cache->render - cache->entries[i].last_render <
+		    LAYOUT_CACHE_AGE) {
+			count++;
+		}
+	}
+	while (size < 2 * (count + need)) {
+		size *= 2;
+	}
+	entries = (struct layout_entry*)calloc(size, sizeof(*entries));
+	if (entries == NULL) {
+		return STATUS_ERR;
+	}
+	for (i = 0; i < cache->size; i++) {
+		if (!cache->entries[i].used) {
+			continue;
+		}
+		if (cache->render - cache->entries[i].last_render <
+		    LAYOUT_CACHE_AGE) {
+			layout_cache_insert(entries, size, &cache->entries[i]);
+		} else {
+			block_layout_free(&cache->entries[i].block);
+		}
+	}
+	free(cache->entries);
+	cache->entries = entries;
+	cache->count = count;
+	cache->size = size;
+	return STATUS_OK;
+}
+
+// Called at the start of each render.
+static int
+layout_cache_begin(struct layout_cache *cache)
+{
+	cache->render++;
+	return layout_cache_rebuild(cache, 0);
+}
+
+// Move block into the cache, leaving it empty.  Not caching it is
+// not an error.
+static void
+layout_cache_add(struct layout_cache *cache, const struct layout_key *key,
+		 struct block_layout *block)
+{
+	struct layout_entry entry = { };
+
+	if (layout_cache_find(cache, key) != NULL) {
+		return;
+	}
+	if (2 * (cache->count + 1) > cache->size &&
+	    layout_cache_rebuild(cache, cache->size / 2 + 1) == STATUS_ERR) {
+		return;
+	}
+	entry.used = true;
+	entry.key = *key;
+	entry.last_render = cache->render;
+	entry.block = *block;
+	layout_cache_insert(cache->entries, cache->size, &entry);
+	cache->count++;
+	memset(block, 0, sizeof(*block));
+}
+
+static void
+layout_cache_free(struct layout_cache *cache)
+{
+	size_t i;
+
+	for (i = 0; i < cache->size; i++) {
+		if (cache->entries[i].used) {
+			block_layout_free(&cache->entries[i].block);
+		}
+	}
+	free(cache->entries);
+	memset(cache, 0, sizeof(*cache));
+}
+
+void cmark_pdf_config_init(cmark_pdf_config *config)
+{
+	config->image_dpi = 0;
+	config->layout_threads = 0;
+	config->compression_level = -1;
+	config->compression_threads = 0;
+	config->allocator = CMARK_PDF_ALLOC_SYSTEM;
+}
+
+// Set up state for a document in fonts->pdf, which must be open.
+static void
+init_state(struct render_state *state, struct font_cache *fonts,
+	   int options, const cmark_pdf_config *config)
+{
+	set_font_paths(state->font_paths);
+	state->pdf = fonts->pdf;
+	state->font_cache = fonts;
+	state->widths = fonts->widths;
+	state->options = options;
+	state->config = *config;
+	state->style = 0;
+	state->base_font_size = 10;
+	state->current_font_size = 10;
+	state->leading = 4;
+	state->indent = 0;
+	state->list_indent_level = 0;
+	state->link_dest = NULL;
+	// the size of new pages, which only libharu knows when drawing
+	state->page_height = HPDF_DEF_PAGE_HEIGHT;
+}
+
+static void
+free_state(struct render_state *state)
+{
+	int i;
+
+	box_buffer_free(&state->boxes);
+	block_layout_free(&state->layout);
+	free(state->text_buf);
+	free(state->item_numbers);
+	image_cache_free(&state->images);
+	for (i = 0; i < 8; i++) {
+		width_cache_free(&state->local_widths[i]);
+	}
+}
+
+// Lay out a top-level block into state->layout.
+static int
+layout_block(struct render_state *state, cmark_node *block)
+{
+	cmark_iter * iter = cmark_iter_new(block);
+	cmark_event_type ev_type;
+	cmark_node * cur;
+	int status = STATUS_OK;
+
+	while ((ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+		cur = cmark_iter_get_node(iter);
+		status = S_render_node(cur, ev_type, state, state->options);
+		if (status == STATUS_ERR) {
+			break;
+		}
+		if (status == STATUS_SKIP &&
+		    cmark_node_last_child(cur)) {
+			// skip processing children
+			cmark_iter_reset(iter, cur, CMARK_EVENT_EXIT);
+			status = STATUS_OK;
+		}
+	}
+	cmark_iter_free(iter);
+	return status;
+}
+
+struct layout_thread {
+	struct layout_pool * pool;
+	struct render_state state;
+	pthread_t thread;
+};
+
+// Claim the next job, if it is not too far ahead of placing.  The
+// pool must be locked.
+static struct layout_job *
+claim_job(struct layout_pool *pool)
+{
+	if (pool->stop || pool->next >= pool->count ||
+	    pool->next >= pool->placed + pool->window) {
+		return NULL;
+	}
+	return &pool->jobs[pool->next++];
+}
+
+// Lay out a claimed job with the state of a layout thread, unless it
+// is in the layout cache.
+static int
+run_job(struct layout_pool *pool, struct render_state *state,
+	struct layout_job *job)
+{
+	int status;
+
+	if (pool->layouts) {
+		block_key(job->node, pool->options, pool->config, &job->key);
+		if (layout_cache_lookup(pool->layouts, &job->key)) {
+			job->cached = true;
+			return STATUS_OK;
+		}
+	}
+	block_layout_clear(&state->layout);
+	state->unmeasured = false;
+	status = layout_block(state, job->node);
+	job->unmeasured = state->unmeasured;
+	job->layout = state->layout;
+	memset(&state->layout, 0, sizeof(state->layout));
+	return status;
+}
+
+// Mark a job ready.  The pool must be locked.
+static void
+finish_job(struct layout_pool *pool, struct layout_job *job, int status)
+{
+	job->status = status;
+	job->ready = true;
+	if (status == STATUS_ERR) {
+		pool->stop = true;
+		pthread_cond_broadcast(&pool->claimable);
+	}
+	pthread_cond_broadcast(&pool->ready);
+}
+
+// Lay out jobs as they may be claimed, until there are none left.
+// Nothing here touches the document being rendered.
+static void *
+run_layout_thread(void *arg)
+{
+	struct layout_thread * thread = (struct layout_thread*)arg;
+	struct layout_pool * pool = thread->pool;
+	struct layout_job * job;
+	int status;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop && pool->next < pool->count) {
+		job = claim_job(pool);
+		if (job == NULL) {
+			pthread_cond_wait(&pool->claimable, &pool->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		status = run_job(pool, &thread->state, job);
+		pthread_mutex_lock(&pool->lock);
+		finish_job(pool, job, status);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Wait for job to be ready, laying out the jobs that may be claimed
+// meanwhile with state.
+static int
+wait_job(struct layout_pool *pool, struct render_state *state,
+	 struct layout_job *job)
+{
+	struct layout_job * other;
+	int status;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!job->ready && !pool->stop) {
+		other = claim_job(pool);
+		if (other == NULL) {
+			pthread_cond_wait(&pool->ready, &pool->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		status = run_job(pool, state, other);
+		pthread_mutex_lock(&pool->lock);
+		finish_job(pool, other, status);
+	}
+	status = job->ready ? job->status : STATUS_ERR;
+	pthread_mutex_unlock(&pool->lock);
+	return status;
+}
+
+// Place a laid-out job, laying it out again with the document's fonts
+// if it needed a width that could not be measured without them.
+static int
+place_job(struct render_state *state, struct layout_job *job)
+{
+	state->block = job->node;
+	if (job->cached) {
+		return place_items(state,
+				   layout_cache_find(state->layouts, &job->key));
+	}
+	if (job->unmeasured) {
+		block_layout_free(&job->layout);
+		block_layout_clear(&state->layout);
+		if (layout_block(state, job->node) == STATUS_ERR) {
+			return STATUS_ERR;
+		}
+		job->layout = state->layout;
+		memset(&state->layout, 0, sizeof(state->layout));
+	}
+	return place_items(state, &job->layout);
+}
+
+// Lay out the count top-level blocks of root on threads threads, the
+// calling thread being the first, placing each in order as soon as it
+// is ready.  The widths measured meanwhile go in the font cache, and
+// the layouts in the layout cache, once the threads are done.
+static int
+render_parallel(struct render_state *state, cmark_node *root,
+		int threads, size_t count)
+{
+	struct layout_pool pool = { };
+	struct layout_thread * thread;
+	struct layout_job * job;
+	cmark_node * cur = cmark_node_first_child(root);
+	struct stat st;
+	int started = 0;
+	int status = STATUS_OK;
+	size_t i;
+	int t, j;
+
+	pool.jobs = (struct layout_job*)calloc(count, sizeof(*pool.jobs));
+	thread = (struct layout_thread*)calloc(threads, sizeof(*thread));
+	if (pool.jobs == NULL || thread == NULL) {
+		free(pool.jobs);
+		free(thread);
+		err("Could not allocate layout jobs");
+	}
+	for (i = 0; i < count; i++, cur = cmark_node_next(cur)) {
+		pool.jobs[i].node = cur;
+	}
+	pool.count = count;
+	pool.window = (size_t)threads * PARALLEL_LAYOUT_BATCH;
+	pool.options = state->options;
+	pool.config = &state->config;
+	pool.fonts = state->font_cache;
+	pool.layouts = state->layouts;
+	// threads can only measure with fonts already loaded, and the
+	// first block to use one may be far ahead of placing, so all
+	// there are are loaded now, though only those used are added
+	for (j = 0; j < 8; j++) {
+		if (!pool.fonts->names[j] &&
+		    stat(state->font_paths[j], &st) == 0 &&
+		    font_cache_load(pool.fonts, state->font_paths[j],
+				    j) == NULL) {
+			HPDF_ResetError(state->pdf);
+		}
+		if (pool.fonts->names[j]) {
+			pool.defs[j] = HPDF_Doc_FindFontDef(state->pdf,
+							    pool.fonts->names[j]);
+		}
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_mutex_init(&pool.fonts_lock, NULL);
+	pthread_cond_init(&pool.claimable, NULL);
+	pthread_cond_init(&pool.ready, NULL);
+	state->pool = &pool;
+
+	for (t = 0; t < threads; t++) {
+		thread[t].pool = &pool;
+		init_state(&thread[t].state, pool.fonts, pool.options,
+			   pool.config);
+		thread[t].state.pdf = NULL;
+		thread[t].state.pool = &pool;
+		thread[t].state.copy_text = pool.layouts != NULL;
+	}
+	for (t = 1; t < threads; t++) {
+		if (pthread_create(&thread[t].thread, NULL,
+				   run_layout_thread, &thread[t]) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < count && status != STATUS_ERR; i++) {
+		job = &pool.jobs[i];
+		status = wait_job(&pool, &thread[0].state, job);
+		if (status != STATUS_ERR) {
+			status = place_job(state, job);
+		}
+		if (!pool.layouts) {
+			block_layout_free(&job->layout);
+		}
+		pthread_mutex_lock(&pool.lock);
+		pool.placed = i + 1;
+		if (status == STATUS_ERR) {
+			pool.stop = true;
+		}
+		pthread_cond_broadcast(&pool.claimable);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	for (t = 1; t <= started; t++) {
+		pthread_join(thread[t].thread, NULL);
+	}
+	state->pool = NULL;
+
+	for (j = 0; j < 8; j++) {
+		for (t = 0; t < threads; t++) {
+			width_cache_merge(&state->widths[j],
+					  &thread[t].state.local_widths[j]);
+		}
+		width_cache_merge(&state->widths[j], &state->local_widths[j]);
+		width_cache_free(&state->local_widths[j]);
+	}
+	for (t = 0; t < threads; t++) {
+		free_state(&thread[t].state);
+	}
+	for (i = 0; i < count; i++) {
+		job = &pool.jobs[i];
+		if (status != STATUS_ERR && pool.layouts && !job->cached) {
+			layout_cache_add(pool.layouts, &job->key,
+					 &job->layout);
+		}
+		block_layout_free(&job->layout);
+	}
+	pthread_cond_destroy(&pool.ready);
+	pthread_cond_destroy(&pool.claimable);
+	pthread_mutex_destroy(&pool.fonts_lock);
+	pthread_mutex_destroy(&pool.lock);
+	free(thread);
+	free(pool.jobs);
+	return status;
+}
+
+// Lay out and draw root into a new document in fonts->pdf, which is
+// left open for the caller to save and then free with HPDF_FreeDoc.
+// If layouts is not NULL, top-level blocks laid out by earlier
+// renders are taken from it rather than laid out again.  Long
+// documents are laid out on up to threads threads.  If pagination is
+// not NULL, nothing is drawn, and where the blocks go is added to it
+// instead.
+static int
+render_document(struct font_cache *fonts, cmark_node *root, int options,
+		const cmark_pdf_config *config, struct layout_cache *layouts,
+		int threads, cmark_pdf_pagination *pagination)
+{
+	struct render_state state = { };
+	cmark_node *cur;
+	size_t count = 0;
 
-	case CMARK_NODE_LIST:
-		if (entering) {
-			state->list_indent_level++;
-		} else {
-			state->list_indent_level--;
+	if (threads > 1) {
+		for (cur = cmark_node_first_child(root); cur;
+		     cur = cmark_node_next(cur)) {
+			count++;
 		}
-		break;
+		if (count / PARALLEL_LAYOUT_MIN_BLOCKS < (size_t)threads) {
+			threads = count / PARALLEL_LAYOUT_MIN_BLOCKS;
+		}
+	}
 
-	case CMARK_NODE_HRULE:
-		parbreak(state, 0);
-		HPDF_Page_MoveTo(state->page, state->x, state->y + state->leading);
-		HPDF_Page_LineTo(state->page, state->x + (TEXT_WIDTH - (state->x - MARGIN_LEFT)), state->y + state->leading);
-		HPDF_Page_Stroke(state->page);
-		state->last_text_y = state->y;
-		state->y -= (state->current_font_size + state->leading);
-		state->x = MARGIN_LEFT + state->indent;
-		break;
+	if (font_cache_open(fonts) == STATUS_ERR) {
+		return STATUS_ERR;
+	}
+	init_state(&state, fonts, options, config);
 
-	case CMARK_NODE_BLOCK_QUOTE:
-		if (entering) {
-			state->indent += state->base_font_size * 2;
-			state->current_font_size = state->base_font_size - 2;
-		} else {
-			state->current_font_size = state->base_font_size;
-			state->indent -= state->base_font_size * 2;
+	/* set compression mode: at a given level, streams are deflated
+	   after libharu saves them */
+	HPDF_SetCompressionMode (state.pdf, config->compression_level < 0 ?
+				 HPDF_COMP_ALL : HPDF_COMP_NONE);
+
+	cmark_event_type ev_type;
+	cmark_iter *iter;
+	int status;
+	bool top;
+	struct layout_key key;
+	struct block_layout * cached;
+
+	// load main font: others loaded lazily as needed
+	status = mark_glyphs(&state);
+	if (status != STATUS_ERR) {
+		status = load_font(&state, 0);
+	}
+	if (status != STATUS_ERR && layouts &&
+	    layout_cache_begin(layouts) == STATUS_ERR) {
+		layouts = NULL;
+	}
+	state.layouts = layouts;
+	state.copy_text = layouts != NULL;
+	state.pagination = pagination;
+
+	if (status != STATUS_ERR && threads > 1) {
+		status = render_parallel(&state, root, threads, count);
+		if (pagination) {
+			pagination->pages = state.pages;
 		}
-		break;
+		free_state(&state);
+		return status;
+	}
 
-	case CMARK_NODE_PARAGRAPH:
-		if (entering) {
-			if (parbreak(state, 0) == STATUS_ERR) {
-				return STATUS_ERR;
-			}
-		} else {
-			if (process_boxes(state, true) == STATUS_ERR) {
-				return STATUS_ERR;
+	// without a cache, lines are placed as they are laid out
+	state.place_lines = layouts == NULL;
+	iter = cmark_iter_new(root);
+	while (status != STATUS_ERR &&
+	       (ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+		cur = cmark_iter_get_node(iter);
+		// top-level blocks start with the same state, so their
+		// layout depends only on their content
+		top = cmark_node_parent(cur) == root;
+		if (top && ev_type == CMARK_EVENT_ENTER) {
+			state.block = cur;
+		}
+		if (top && layouts && ev_type == CMARK_EVENT_ENTER) {
+			block_key(cur, options, config, &key);
+			cached = layout_cache_find(layouts, &key);
+			if (cached != NULL) {
+				status = place_items(&state, cached);
+				if (!is_leaf(cur)) {
+					cmark_iter_reset(iter, cur,
+							 CMARK_EVENT_EXIT);
+				}
+				continue;
 			}
 		}
-		break;
-
-	case CMARK_NODE_CODE_BLOCK:
-		parbreak(state, 0);
-		status = render_text(state, cmark_node_get_literal(node), false, state->style | MONOSPACE);
+		status = S_render_node(cur, ev_type, &state, options);
 		if (status == STATUS_ERR) {
-			return STATUS_ERR;
+			break;
 		}
-		status = process_boxes(state, false);
-		if (status == STATUS_ERR) {
-			return STATUS_ERR;
+		if (status == STATUS_SKIP &&
+		    cmark_node_last_child(cur)) {
+			// skip processing children
+			cmark_iter_reset(iter, cur, CMARK_EVENT_EXIT);
+			status = STATUS_OK;
 		}
-		state->y -= (state->current_font_size + state->leading);
-		return STATUS_OK;
-
-	case CMARK_NODE_HEADER:
-		if (entering) {
-			int lev = cmark_node_get_header_level(node);
-			state->current_font_size = state->base_font_size * (1.66 - (lev/6));
-			parbreak(state, 3 * state->current_font_size);
-		} else {
-			if (process_boxes(state, true) == STATUS_ERR) {
-				return STATUS_ERR;
-			}
-			state->y -= (0.3 * (state->current_font_size + state->leading));
-			state->current_font_size = state->base_font_size;
+		if (!layouts) {
+			status = place_items(&state, &state.layout);
+			block_layout_clear(&state.layout);
+		} else if (top && (ev_type == CMARK_EVENT_EXIT ||
+				   is_leaf(cur))) {
+			status = place_items(&state, &state.layout);
+			layout_cache_add(layouts, &key, &state.layout);
+			block_layout_clear(&state.layout);
 		}
-		break;
+	}
 
-	case CMARK_NODE_CODE:
-		return render_text(state, cmark_node_get_literal(node), true, state->style | MONOSPACE);
+	cmark_iter_free(iter);
+	if (pagination) {
+		pagination->pages = state.pages;
+	}
 
-	case CMARK_NODE_SOFTBREAK:
-		return push_box(state, SPACE, NULL, 0);
+	/* clean up */
+	free_state(&state);
 
-	case CMARK_NODE_LINEBREAK:
-		return push_box(state, BREAK, NULL, 0);
+	return status;
+}
 
-	case CMARK_NODE_TEXT:
-		return render_text(state, cmark_node_get_literal(node), true, state->style);
+// Pass the saved document to write a block at a time.
+static int
+write_document(HPDF_Doc pdf, cmark_pdf_write_func write, void *userdata)
+{
+	HPDF_BYTE buffer[4096];
+	HPDF_UINT32 size;
+	HPDF_UINT32 remaining;
+	HPDF_STATUS ret;
 
-	case CMARK_NODE_LINK:
-		if (entering) {
-			state->link_dest = cmark_node_get_url(node);
-		} else {
-			state->link_dest = NULL;
+	if (HPDF_SaveToStream(pdf) != HPDF_OK) {
+		err("Could not save PDF to memory");
+	}
+	HPDF_ResetStream(pdf);
+	remaining = HPDF_GetStreamSize(pdf);
+	// asking for more than is left makes libharu report an error
+	while (remaining > 0) {
+		size = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+		ret = HPDF_ReadFromStream(pdf, buffer, &size);
+		if ((ret != HPDF_OK && ret != HPDF_STREAM_EOF) || size == 0) {
+			err("Could not read PDF from memory");
 		}
-		break;
-
-	case CMARK_NODE_IMAGE:
-		if (entering) {
-			image_path = cmark_node_get_url(node);
-		        image = HPDF_LoadPngImageFromFile(state->pdf, image_path);
-			if (image == NULL) {
-				fprintf(stderr,
-					"Could not load PNG image '%s'\n",
-					image_path);
-				HPDF_ResetError(state->pdf);
-				return STATUS_OK;
-			} else if (push_image_box(state, image) == STATUS_ERR) {
-				return STATUS_ERR;
-			}
-			return STATUS_SKIP;
+		if (!write(buffer, size, userdata)) {
+			err("Could not write PDF");
 		}
-		break;
+		remaining -= size;
+	}
+	return STATUS_OK;
+}
 
-	case CMARK_NODE_EMPH:
-		if (entering) {
-			state->style |= ITALIC;
-		} else {
-			state->style &= ~ITALIC;
-		}
-		break;
+struct output_buffer {
+	unsigned char * data;
+	size_t len;
+	size_t size;
+};
 
-	case CMARK_NODE_STRONG:
-		if (entering) {
-			state->style |= BOLD;
-		} else {
-			state->style &= ~BOLD;
+static int
+write_buffer(const unsigned char *data, size_t len, void *userdata)
+{
+	struct output_buffer * out = (struct output_buffer*)userdata;
+	unsigned char * p;
+	size_t size;
+
+	if (out->len + len > out->size) {
+		size = out->size ? out->size : 64 * 1024;
+		while (size < out->len + len) {
+			size *= 2;
 		}
-		break;
-
-	default:
-		break;
+		p = (unsigned char*)realloc(out->data, size);
+		if (p == NULL) {
+			return 0;
+		}
+		out->data = p;
+		out->size = size;
 	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+	return 1;
+}
 
-	return STATUS_OK;
+static int
+write_file(const unsigned char *data, size_t len, void *userdata)
+{
+	return fwrite(data, 1, len, (FILE*)userdata) == len;
+}
+
+// Pass the saved document to write, with its streams deflated on
+// threads first if the configuration gives a level.
+static int
+output_document(HPDF_Doc pdf, const cmark_pdf_config *config,
+		cmark_pdf_write_func write, void *userdata)
+{
+	struct output_buffer out = { };
+	const unsigned char * data;
+	int status;
+
+	if (config->compression_level <= 0) {
+		return write_document(pdf, write, userdata);
+	}
+	status = write_document(pdf, write_buffer, &out);
+	data = out.data;
+	if (status == STATUS_OK &&
+	    !merge_pdfs(&data, &out.len, 1, config->compression_level,
+			config->compression_threads, write, userdata)) {
+		status = STATUS_ERR;
+		fprintf(stderr, "Could not deflate PDF\n");
+	}
+	free(out.data);
+	return status;
 }
 
+static int
+save_document(HPDF_Doc pdf, const cmark_pdf_config *config,
+	      const char *outfile)
+{
+	FILE * fp;
+	int status;
+
+	/* save the document to a file */
+	if (config->compression_level <= 0) {
+		if (HPDF_SaveToFile (pdf, outfile) != HPDF_OK) {
+			errf("Could not save PDF to file '%s'", outfile);
+		}
+		return STATUS_OK;
+	}
+	fp = fopen(outfile, "wb");
+	if (fp == NULL) {
+		errf("Could not save PDF to file '%s'", outfile);
+	}
+	status = output_document(pdf, config, write_file, fp);
+	if (fclose(fp) != 0 && status == STATUS_OK) {
+		errf("Could not save PDF to file '%s'", outfile);
+	}
+	return status;
+}
 
 // Returns 1 on success, 0 on failure.
 int cmark_render_pdf(cmark_node *root, int options, char *outfile)
 {
-	struct render_state state = { };
-	state.font_paths[0] = FONT_PATH MAIN_FONT ".ttf";
-	state.font_paths[BOLD] = FONT_PATH MAIN_FONT_B ".ttf";
-	state.font_paths[ITALIC] = FONT_PATH MAIN_FONT_I ".ttf";
-	state.font_paths[BOLD + ITALIC] = FONT_PATH MAIN_FONT_BI ".ttf";
-	state.font_paths[MONOSPACE] = FONT_PATH TT_FONT ".ttf";
-	state.font_paths[MONOSPACE + BOLD] = FONT_PATH TT_FONT_B ".ttf";
-	state.font_paths[MONOSPACE + ITALIC] = FONT_PATH TT_FONT_I ".ttf";
-	state.font_paths[MONOSPACE + BOLD + ITALIC] = FONT_PATH TT_FONT_BI ".ttf";
-
-	state.pdf = HPDF_New (error_handler, NULL);
-	if (!state.pdf) {
-		err("Cannot create PdfDoc object");
+	cmark_pdf_config config;
+
+	cmark_pdf_config_init(&config);
+	return cmark_render_pdf_with_config(root, options, &config, outfile);
+}
+
+// Returns 1 on success, 0 on failure.
+int cmark_render_pdf_with_config(cmark_node *root, int options,
+				 const cmark_pdf_config *config,
+				 char *outfile)
+{
+	struct pdf_allocator * previous;
+	int status;
+
+	// the fonts are kept with the allocator they were loaded with
+	if (default_fonts.alloc.kind != config->allocator) {
+		font_cache_free(&default_fonts);
+		default_fonts.alloc.kind = config->allocator;
+	}
+	previous = pdf_allocator_enter(&default_fonts.alloc);
+	status = render_document(&default_fonts, root, options, config, NULL,
+				 0, NULL);
+	if (status == STATUS_OK) {
+		status = save_document(default_fonts.pdf, config, outfile);
 	}
+	// keep the fonts for the next document
+	if (default_fonts.pdf) {
+		font_cache_close(&default_fonts);
+	}
+	pdf_allocator_leave(previous);
 
-	if (HPDF_UseUTFEncodings(state.pdf) != HPDF_OK) {
-		err("Cannot set UTF-8 encoding");
-	};
+	return status;
+}
+
+void cmark_pdf_free_fonts(void)
+{
+	font_cache_free(&default_fonts);
+}
 
-	/* set compression mode */
-	HPDF_SetCompressionMode (state.pdf, HPDF_COMP_ALL);
+cmark_pdf_renderer *cmark_pdf_renderer_new(int options,
+					   const cmark_pdf_config *config)
+{
+	cmark_pdf_renderer * renderer;
+
+	renderer = (cmark_pdf_renderer*)calloc(1, sizeof(*renderer));
+	if (renderer == NULL) {
+		return NULL;
+	}
+	renderer->options = options;
+	if (config) {
+		renderer->config = *config;
+	} else {
+		cmark_pdf_config_init(&renderer->config);
+	}
 
-	state.style = 0;
-	state.base_font_size = 10;
-	state.current_font_size = 10;
-	state.leading = 4;
-	state.indent = 0;
-	state.boxes_bottom = NULL;
-	state.boxes_top = NULL;
-	state.list_indent_level = 0;
-	state.link_dest = NULL;
+	// fonts are parsed as renders first need them
+	renderer->fonts.alloc.kind = renderer->config.allocator;
+	return renderer;
+}
 
-	// load main font: others loaded lazily as needed
-	if (load_font(&state, 0) == STATUS_ERR) {
-		return STATUS_ERR;
+void cmark_pdf_renderer_free(cmark_pdf_renderer *renderer)
+{
+	int i;
+
+	if (renderer == NULL) {
+		return;
+	}
+	font_cache_free(&renderer->fonts);
+	layout_cache_free(&renderer->layouts);
+	for (i = 0; i < 8; i++) {
+		free(renderer->fonts.glyphs[i]);
+	}
+	free(renderer);
+}
+
+void cmark_pdf_renderer_alloc_stats(const cmark_pdf_renderer *renderer,
+				    cmark_pdf_alloc_stats *stats)
+{
+	*stats = renderer->fonts.alloc.stats;
+}
+
+void cmark_pdf_font_paths(const char **paths)
+{
+	set_font_paths(paths);
+}
+
+void cmark_pdf_renderer_set_options(cmark_pdf_renderer *renderer,
+				    int options)
+{
+	renderer->options = options;
+}
+
+// Add the characters of text to the glyph set of style.  Loading a
+// font always marks "i \n", so a new set starts with those.
+static int
+add_glyphs(struct font_cache *fonts, int style, const char *text)
+{
+	const unsigned char * s = (const unsigned char *)text;
+	unsigned char * set = fonts->glyphs[style];
+	int len = strlen(text);
+	uint32_t c;
+	int i = 0;
+	int n;
+
+	if (set == NULL) {
+		set = (unsigned char*)calloc(GLYPH_SET_SIZE, 1);
+		if (set == NULL) {
+			err("Could not allocate glyph set");
+		}
+		fonts->glyphs[style] = set;
+		add_glyphs(fonts, style, "i \n");
+	}
+	while (i < len) {
+		n = utf8_decode(s + i, len - i, &c);
+		if (n == 0) {
+			i++;
+			continue;
+		}
+		if (c < 0x10000) {
+			set[c / 8] |= 1 << c % 8;
+		}
+		i += n;
 	}
+	return STATUS_OK;
+}
 
+// Returns 1 on success, 0 on failure.
+int cmark_pdf_renderer_mark_text(cmark_pdf_renderer *renderer,
+				 cmark_node *root)
+{
+	struct font_cache * fonts = &renderer->fonts;
 	cmark_event_type ev_type;
-	cmark_node *cur;
-	cmark_iter *iter = cmark_iter_new(root);
-	int status = STATUS_OK;
+	cmark_node * cur;
+	cmark_iter * iter;
+	bool entering;
+	int style = 0;
+	int status;
 
-	while ((ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
+	// soft and hard line breaks are in the main font
+	status = add_glyphs(fonts, 0, "");
+	iter = cmark_iter_new(root);
+	while (status != STATUS_ERR &&
+	       (ev_type = cmark_iter_next(iter)) != CMARK_EVENT_DONE) {
 		cur = cmark_iter_get_node(iter);
-		status = S_render_node(cur, ev_type, &state, options);
-		if (status == STATUS_ERR) {
+		entering = ev_type == CMARK_EVENT_ENTER;
+		switch (cmark_node_get_type(cur)) {
+		case CMARK_NODE_LIST:
+			// item markers: bullets, or numbers right-aligned
+			status = add_glyphs(fonts, 0,
+					    "\xE2\x97\xA6\xE2\x80\xA2"
+					    "0123456789.");
+			break;
+		case CMARK_NODE_EMPH:
+			style = entering ? style | ITALIC : style & ~ITALIC;
+			break;
+		case CMARK_NODE_STRONG:
+			style = entering ? style | BOLD : style & ~BOLD;
+			break;
+		case CMARK_NODE_TEXT:
+			status = add_glyphs(fonts, style,
+					    cmark_node_get_literal(cur));
+			break;
+		case CMARK_NODE_CODE:
+		case CMARK_NODE_CODE_BLOCK:
+			status = add_glyphs(fonts, style | MONOSPACE,
+					    cmark_node_get_literal(cur));
+			break;
+		default:
 			break;
-		}
-		if (status == STATUS_SKIP &&
-		    cmark_node_last_child(cur)) {
-			// skip processing children
-			cmark_iter_reset(iter, cur, CMARK_EVENT_EXIT);
-			status = STATUS_OK;
 		}
 	}
-
 	cmark_iter_free(iter);
+	return status;
+}
+
+// Returns 1 on success, 0 on failure.
+int cmark_pdf_render(cmark_pdf_renderer *renderer, cmark_node *root,
+		     cmark_pdf_write_func write, void *userdata)
+{
+	struct pdf_allocator * previous;
+	int status;
 
+	previous = pdf_allocator_enter(&renderer->fonts.alloc);
+	status = render_document(&renderer->fonts, root, renderer->options,
+				 &renderer->config,
+				 renderer->options & CMARK_PDF_OPT_INCREMENTAL ?
+				 &renderer->layouts : NULL,
+				 renderer->config.layout_threads,
+				 NULL);
 	if (status == STATUS_OK) {
-		/* save the document to a file */
-		if (HPDF_SaveToFile (state.pdf, outfile) != HPDF_OK) {
-			errf("Could not save PDF to file '%s'", outfile);
-			status = STATUS_ERR;
-		}
+		status = output_document(renderer->fonts.pdf,
+					 &renderer->config, write, userdata);
 	}
+	if (renderer->fonts.pdf) {
+		font_cache_close(&renderer->fonts);
+	}
+	pdf_allocator_leave(previous);
+	return status;
+}
 
-	/* clean up */
-	HPDF_Free (state.pdf);
+// Returns 1 on success, 0 on failure.
+int cmark_pdf_render_to_buffer(cmark_pdf_renderer *renderer,
+			       cmark_node *root,
+			       unsigned char **data, size_t *len)
+{
+	struct output_buffer out = { };
+	unsigned char * p;
+
+	if (!cmark_pdf_render(renderer, root, write_buffer, &out)) {
+		free(out.data);
+		return 0;
+	}
+	// the buffer grew by doubling, and may be held for a while
+	p = (unsigned char*)realloc(out.data, out.len);
+	if (p != NULL) {
+		out.data = p;
+	}
+	*data = out.data;
+	*len = out.len;
+	return 1;
+}
+
+// Returns 1 on success, 0 on failure.
+int cmark_pdf_paginate(cmark_pdf_renderer *renderer, cmark_node *root,
+		       cmark_pdf_pagination *pagination)
+{
+	struct pdf_allocator * previous;
+	int status;
 
+	memset(pagination, 0, sizeof(*pagination));
+	previous = pdf_allocator_enter(&renderer->fonts.alloc);
+	status = render_document(&renderer->fonts, root, renderer->options,
+				 &renderer->config,
+				 renderer->options & CMARK_PDF_OPT_INCREMENTAL ?
+				 &renderer->layouts : NULL,
+				 renderer->config.layout_threads,
+				 pagination);
+	// the document has no pages, and is only needed for the fonts
+	if (renderer->fonts.pdf) {
+		font_cache_close(&renderer->fonts);
+	}
+	pdf_allocator_leave(previous);
+	if (status == STATUS_ERR) {
+		cmark_pdf_pagination_free(pagination);
+	}
 	return status;
 }
+
+void cmark_pdf_pagination_free(cmark_pdf_pagination *pagination)
+{
+	free(pagination->blocks);
+	memset(pagination, 0, sizeof(*pagination));
+}
@@ -1,14 +1,144 @@
 #ifndef CMARK_CMARK_PDF_H
 #define CMARK_CMARK_PDF_H
 
+#include <stddef.h>
 #include <cmark.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Options for cmark_render_pdf, in addition to the CMARK_OPT_* ones.
+// They use high bits that cmark leaves alone.
+
+// Break paragraphs with the Knuth-Plass total-fit algorithm instead
+// of the greedy one.
+#define CMARK_PDF_OPT_OPTIMAL_BREAKS (1 << 24)
+
+// Keep the layout of each top-level block in the renderer and reuse
+// it when a later render has the same block, so that re-rendering an
+// edited document only lays out the blocks that changed.  Only used
+// by cmark_pdf_render and cmark_pdf_render_to_buffer.
+#define CMARK_PDF_OPT_INCREMENTAL (1 << 25)
+
+// Where the libharu documents a renderer keeps get their memory:
+// libharu's own use of malloc and free, an arena that large blocks are
+// handed out from and given back all at once when the document is
+// freed, or malloc and free with the allocations counted.
+#define CMARK_PDF_ALLOC_SYSTEM 0
+#define CMARK_PDF_ALLOC_ARENA 1
+#define CMARK_PDF_ALLOC_COUNTING 2
+
+// Settings for the renderer that don't fit in the options bitmask.
+typedef struct cmark_pdf_config {
+	// Resolution images are downsampled to before they are
+	// embedded, or 0 to embed all their pixels.
+	int image_dpi;
+	// Most threads a renderer lays out the top-level blocks of long
+	// documents on, or 0 or 1 to lay out on the calling thread.
+	// The output is the same either way.
+	int layout_threads;
+	// Level the streams in the PDF are deflated at, from 1 (fastest)
+	// to 9 (smallest), 0 to leave them uncompressed, or -1 to have
+	// libharu deflate them at its default level as it saves.
+	int compression_level;
+	// Threads streams are deflated on at levels 1 to 9, or 0 or 1 to
+	// deflate them on the calling thread.
+	int compression_threads;
+	// One of the CMARK_PDF_ALLOC_* allocators.
+	int allocator;
+} cmark_pdf_config;
+
+// Fill config with the defaults.
+void cmark_pdf_config_init(cmark_pdf_config *config);
+
 int cmark_render_pdf(cmark_node *root, int options, char *outfile);
 
+int cmark_render_pdf_with_config(cmark_node *root, int options,
+				 const cmark_pdf_config *config,
+				 char *outfile);
+
+// Fonts loaded by one render are kept for the next, so renders must
+// not overlap.  Release them.
+void cmark_pdf_free_fonts(void);
+
+// Set paths[0] to paths[7] to the font files rendering uses.
+void cmark_pdf_font_paths(const char **paths);
+
+// A renderer holds the options, configuration and parsed fonts for
+// rendering any number of documents, one at a time, to memory.
+typedef struct cmark_pdf_renderer cmark_pdf_renderer;
+
+// Called with each block of a rendered PDF.  Returns 1 on success,
+// 0 to stop rendering.
+typedef int (*cmark_pdf_write_func)(const unsigned char *data,
+				    size_t len, void *userdata);
+
+// Fonts are parsed when a render first needs them, and kept.  config
+// may be NULL for the defaults.  Returns NULL on failure.
+cmark_pdf_renderer *cmark_pdf_renderer_new(int options,
+					   const cmark_pdf_config *config);
+
+void cmark_pdf_renderer_free(cmark_pdf_renderer *renderer);
+
+// Change the options used for the next render.
+void cmark_pdf_renderer_set_options(cmark_pdf_renderer *renderer,
+				    int options);
+
+// Subset the characters of root in every later render, as well as
+// those it uses, so that PDFs to be merged have the same font subsets
+// and can share them.  Calls add up.
+int cmark_pdf_renderer_mark_text(cmark_pdf_renderer *renderer,
+				 cmark_node *root);
+
+// What the allocators of a renderer's libharu documents have done,
+// added up over the documents.  Only the arena and counting
+// allocators keep count.
+typedef struct cmark_pdf_alloc_stats {
+	size_t allocations;
+	size_t frees;
+	size_t bytes;       // in use, or for an arena, handed out
+	size_t peak_bytes;
+	size_t reserved;    // in arena blocks
+} cmark_pdf_alloc_stats;
+
+void cmark_pdf_renderer_alloc_stats(const cmark_pdf_renderer *renderer,
+				    cmark_pdf_alloc_stats *stats);
+
+// Render root and pass the PDF to write.
+int cmark_pdf_render(cmark_pdf_renderer *renderer, cmark_node *root,
+		     cmark_pdf_write_func write, void *userdata);
+
+// Render root into a new buffer, to be freed by the caller.
+int cmark_pdf_render_to_buffer(cmark_pdf_renderer *renderer,
+			       cmark_node *root,
+			       unsigned char **data, size_t *len);
+
+// Where a top-level block starts: the page, counting from 1, and
+// the baseline of its first line, in points above the bottom of the
+// page.
+typedef struct cmark_pdf_block_position {
+	cmark_node *node;
+	int page;
+	float y;
+} cmark_pdf_block_position;
+
+typedef struct cmark_pdf_pagination {
+	int pages;
+	// in document order; blocks that draw nothing, such as HTML,
+	// are left out
+	cmark_pdf_block_position *blocks;
+	size_t count;
+} cmark_pdf_pagination;
+
+// Lay out root as cmark_pdf_render would, but only work out where
+// its top-level blocks go, without drawing or saving anything.  Free
+// the result with cmark_pdf_pagination_free.
+int cmark_pdf_paginate(cmark_pdf_renderer *renderer, cmark_node *root,
+		       cmark_pdf_pagination *pagination);
+
+void cmark_pdf_pagination_free(cmark_pdf_pagination *pagination);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <pthread.h>
+#include "scan.h"
+
+// Token scanning for render_text.  Literals in code blocks and long
+// paragraphs can be many kilobytes, so on x86 we look for the end of
+// a token 16 (SSE2) or 32 (AVX2) bytes at a time.  The AVX2 path is
+// chosen at runtime; the scalar loop handles everything else,
+// including the tail of the input.
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE2_SCAN 1
+#include <immintrin.h>
+#endif
+
+// Scan forward from p for the end of a token whose first byte is c.
+static const char *
+scan_run_scalar(const char *p, const char *end, char c)
+{
+	if (c == ' ' || c == '\n') {
+		while (p < end && *p == c) {
+			p++;
+		}
+	} else {
+		while (p < end && *p != ' ' && *p != '\n' && *p != 0) {
+			p++;
+		}
+	}
+	return p;
+}
+
+const char *
+scan_token_end_scalar(const char *p, const char *end)
+{
+	return scan_run_scalar(p, end, *p);
+}
+
+#ifdef HAVE_SSE2_SCAN
+
+static const char *
+scan_run_sse2(const char *p, const char *end, char c)
+{
+	const __m128i spaces = _mm_set1_epi8(' ');
+	const __m128i newlines = _mm_set1_epi8('\n');
+	const __m128i zeros = _mm_setzero_si128();
+	const __m128i run = _mm_set1_epi8(c);
+	int in_run = (c == ' ' || c == '\n');
+	__m128i v;
+	unsigned int mask;
+
+	while (end - p >= 16) {
+		v = _mm_loadu_si128((const __m128i *)p);
+		if (in_run) {
+			// bytes that differ from the run character
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, run))
+				^ 0xFFFF;
+		} else {
+			// bytes that end a word
+			mask = _mm_movemask_epi8(
+				_mm_or_si128(_mm_or_si128(
+					_mm_cmpeq_epi8(v, spaces),
+					_mm_cmpeq_epi8(v, newlines)),
+					_mm_cmpeq_epi8(v, zeros)));
+		}
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+	return scan_run_scalar(p, end, c);
+}
+
+static const char *
+scan_token_end_sse2(const char *p, const char *end)
+{
+	return scan_run_sse2(p, end, *p);
+}
+
+__attribute__((target("avx2")))
+static const char *
+scan_token_end_avx2(const char *p, const char *end)
+{
+	const __m256i spaces = _mm256_set1_epi8(' ');
+	const __m256i newlines = _mm256_set1_epi8('\n');
+	const __m256i zeros = _mm256_setzero_si256();
+	const char c = *p;
+	const __m256i run = _mm256_set1_epi8(c);
+	int in_run = (c == ' ' || c == '\n');
+	__m256i v;
+	unsigned int mask;
+
+	while (end - p >= 32) {
+		v = _mm256_loadu_si256((const __m256i *)p);
+		if (in_run) {
+			mask = ~(unsigned int)_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(v, run));
+		} else {
+			mask = _mm256_movemask_epi8(
+				_mm256_or_si256(_mm256_or_si256(
+					_mm256_cmpeq_epi8(v, spaces),
+					_mm256_cmpeq_epi8(v, newlines)),
+					_mm256_cmpeq_epi8(v, zeros)));
+		}
+		if (mask) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+	return scan_run_sse2(p, end, c);
+}
+
+#endif
+
+typedef const char *(*scan_func)(const char *, const char *);
+
+static scan_func
+select_scanner(void)
+{
+#ifdef HAVE_SSE2_SCAN
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return scan_token_end_avx2;
+	}
+	return scan_token_end_sse2;
+#else
+	return scan_token_end_scalar;
+#endif
+}
+
+// Layout threads may all get here first; only one of them picks.
+static pthread_once_t scanner_once = PTHREAD_ONCE_INIT;
+static scan_func selected = scan_token_end_scalar;
+
+static void
+pick_scanner(void)
+{
+	selected = select_scanner();
+}
+
+const char *
+scan_token_end(const char *p, const char *end)
+{
+	pthread_once(&scanner_once, pick_scanner);
+	return selected(p, end);
+}
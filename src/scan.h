@@ -0,0 +1,12 @@
+#ifndef CMARK_PDF_SCAN_H
+#define CMARK_PDF_SCAN_H
+
+// Tokens are maximal runs of spaces, of newlines, or of any other
+// bytes.  Returns the end of the token starting at p (p < end).
+const char *scan_token_end(const char *p, const char *end);
+
+// Same as scan_token_end, but one byte at a time.  The vectorized
+// scanners must always agree with it.
+const char *scan_token_end_scalar(const char *p, const char *end);
+
+#endif
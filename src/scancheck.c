@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "input.h"
+#include "scan.h"
+
+// Check that the scanner render_text uses finds the same token ends as
+// the scalar one, from every offset of the input and for every input
+// end up to a few vectors away, so the tails are covered too.
+
+#define TAIL_CHECK 80
+
+int main(int argc, char *argv[])
+{
+	struct input in;
+	const char * p;
+	const char * end;
+	const char * expected;
+	const char * found;
+	size_t i, k;
+	size_t checks = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: scancheck FILE\n");
+		return 1;
+	}
+	if (!input_open(argv[1], &in)) {
+		fprintf(stderr, "Could not read %s\n", argv[1]);
+		return 1;
+	}
+	for (i = 0; i < in.len; i++) {
+		p = in.data + i;
+		for (k = 1; k <= TAIL_CHECK + 1 && i + k <= in.len; k++) {
+			// the last round checks against the real end
+			end = k > TAIL_CHECK ? in.data + in.len : p + k;
+			expected = scan_token_end_scalar(p, end);
+			found = scan_token_end(p, end);
+			checks++;
+			if (found != expected) {
+				fprintf(stderr, "Token at offset %zu ending "
+					"at %zu: scanner says %zu, scalar "
+					"loop %zu\n", i, (size_t)(end - in.data),
+					(size_t)(found - in.data),
+					(size_t)(expected - in.data));
+				input_close(&in);
+				return 1;
+			}
+		}
+	}
+	printf("%zu token ends agree\n", checks);
+	input_close(&in);
+	return 0;
+}
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <cmark.h>
+#include "serve.h"
+
+#define MAX_HEADER 256
+#define MAX_REQUEST (64 * 1024 * 1024)
+
+// A client that sends or takes nothing for this long is dropped, so
+// that it can't hold a worker forever.
+#define IDLE_SECONDS 30
+
+// How long a worker waits to accept again after a failure that may
+// pass, such as running out of file descriptors.
+#define ACCEPT_RETRY_MS 100
+
+struct server_worker {
+	int listener;
+	int options;
+	cmark_pdf_renderer * renderer;
+	pthread_t thread;
+};
+
+static const struct {
+	const char * name;
+	int option;
+} flags[] = {
+	{ "smart", CMARK_OPT_SMART },
+	{ "hardbreaks", CMARK_OPT_HARDBREAKS },
+	{ "sourcepos", CMARK_OPT_SOURCEPOS },
+	{ "validate-utf8", CMARK_OPT_VALIDATE_UTF8 },
+	{ "optimal-breaks", CMARK_PDF_OPT_OPTIMAL_BREAKS },
+};
+
+static int
+send_all(int fd, const void *data, size_t len)
+{
+	const char * p = (const char*)data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int
+send_error(int fd, const char *msg)
+{
+	char line[MAX_HEADER];
+
+	snprintf(line, sizeof(line), "ERROR %s\n", msg);
+	return send_all(fd, line, strlen(line));
+}
+
+// Parse "LENGTH [FLAG...]".  Returns 0 if it is malformed.
+static int
+parse_header(char *header, size_t *length, int *options)
+{
+	char * word;
+	char * end;
+	char * save;
+	unsigned long n;
+	size_t i;
+
+	word = strtok_r(header, " \r", &save);
+	if (word == NULL) {
+		return 0;
+	}
+	n = strtoul(word, &end, 10);
+	if (*end != '\0' || n > MAX_REQUEST) {
+		return 0;
+	}
+	*length = n;
+	while ((word = strtok_r(NULL, " \r", &save)) != NULL) {
+		for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+			if (strcmp(word, flags[i].name) == 0) {
+				*options |= flags[i].option;
+				break;
+			}
+		}
+		if (i == sizeof(flags) / sizeof(flags[0])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Read a request: the header line, then the Markdown it announces.
+static char *
+read_request(int fd, size_t *len, int *options)
+{
+	char header[MAX_HEADER];
+	char * text;
+	char * newline = NULL;
+	size_t have = 0;
+	size_t extra;
+	ssize_t n;
+
+	while (newline == NULL) {
+		if (have == sizeof(header) - 1) {
+			return NULL;
+		}
+		n = recv(fd, header + have, sizeof(header) - 1 - have, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return NULL;
+		}
+		have += n;
+		header[have] = '\0';
+		newline = memchr(header, '\n', have);
+	}
+	*newline = '\0';
+	if (!parse_header(header, len, options)) {
+		return NULL;
+	}
+
+	text = (char*)malloc(*len ? *len : 1);
+	if (text == NULL) {
+		return NULL;
+	}
+	// bytes after the header line are the start of the text
+	extra = have - (newline + 1 - header);
+	if (extra > *len) {
+		free(text);
+		return NULL;
+	}
+	memcpy(text, newline + 1, extra);
+	while (extra < *len) {
+		n = recv(fd, text + extra, *len - extra, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			free(text);
+			return NULL;
+		}
+		extra += n;
+	}
+	return text;
+}
+
+static void
+handle_request(struct server_worker *worker, int fd)
+{
+	char line[MAX_HEADER];
+	char * text;
+	size_t len;
+	int options = worker->options;
+	cmark_node * document;
+	unsigned char * pdf;
+	size_t pdf_len;
+	int ok;
+
+	text = read_request(fd, &len, &options);
+	if (text == NULL) {
+		send_error(fd, "bad request");
+		return;
+	}
+	document = cmark_parse_document(text, len, options);
+	free(text);
+
+	cmark_pdf_renderer_set_options(worker->renderer, options);
+	ok = cmark_pdf_render_to_buffer(worker->renderer, document,
+					&pdf, &pdf_len);
+	cmark_node_free(document);
+	if (!ok) {
+		send_error(fd, "could not render");
+		return;
+	}
+
+	snprintf(line, sizeof(line), "OK %lu\n", (unsigned long)pdf_len);
+	if (send_all(fd, line, strlen(line))) {
+		send_all(fd, pdf, pdf_len);
+	}
+	free(pdf);
+}
+
+// Each worker takes connections as they come, so a slow request
+// only holds up its own thread.
+static void *
+run_worker(void *arg)
+{
+	struct server_worker * worker = (struct server_worker*)arg;
+	struct timeval idle = { IDLE_SECONDS, 0 };
+	int fd;
+
+	while (1) {
+		fd = accept(worker->listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("accept");
+			// only a listener that is gone stops the worker: out
+			// of descriptors or memory, it waits and tries again
+			if (errno == EBADF || errno == EINVAL) {
+				return NULL;
+			}
+			usleep(ACCEPT_RETRY_MS * 1000);
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+		handle_request(worker, fd);
+		close(fd);
+	}
+}
+
+// Remove a socket left at path by a server that is gone.  Returns 0,
+// with a message, if path is anything else or a server answers there.
+static int
+remove_stale_socket(const char *path, const struct sockaddr_un *addr)
+{
+	struct stat st;
+	int fd;
+	int live;
+
+	if (lstat(path, &st) != 0) {
+		if (errno == ENOENT) {
+			return 1;
+		}
+		fprintf(stderr, "Error checking %s: %s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "Not replacing %s, which is not a socket\n",
+			path);
+		return 0;
+	}
+	// only a socket nothing is listening on is stale
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error checking %s: %s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	live = connect(fd, (const struct sockaddr*)addr,
+		       sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+	close(fd);
+	if (live) {
+		fprintf(stderr, "Not replacing %s, which is in use\n", path);
+		return 0;
+	}
+	if (unlink(path) != 0 && errno != ENOENT) {
+		fprintf(stderr, "Error removing %s: %s\n", path,
+			strerror(errno));
+		return 0;
+	}
+	return 1;
+}
+
+int serve(const char *path, int options, const cmark_pdf_config *config,
+	  int threads)
+{
+	struct sockaddr_un addr;
+	struct server_worker * workers;
+	int listener;
+	int started = 0;
+	int i;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = (struct server_worker*)calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		return 1;
+	}
+	// set up the renderers before taking requests
+	for (i = 0; i < threads; i++) {
+		workers[i].options = options;
+		workers[i].renderer = cmark_pdf_renderer_new(options, config);
+		if (workers[i].renderer == NULL) {
+			break;
+		}
+	}
+	threads = i;
+	if (threads == 0) {
+		free(workers);
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	listener = -1;
+	if (remove_stale_socket(path, &addr)) {
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0 ||
+		    bind(listener, (struct sockaddr*)&addr,
+			 sizeof(addr)) != 0 ||
+		    listen(listener, 64) != 0) {
+			fprintf(stderr, "Error listening on %s: %s\n",
+				path, strerror(errno));
+			if (listener >= 0) {
+				close(listener);
+				listener = -1;
+			}
+		}
+	}
+	if (listener < 0) {
+		for (i = 0; i < threads; i++) {
+			cmark_pdf_renderer_free(workers[i].renderer);
+		}
+		free(workers);
+		return 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		workers[i].listener = listener;
+	}
+	// the calling thread is the first worker
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	run_worker(&workers[0]);
+	for (i = 1; i <= started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	close(listener);
+	for (i = 0; i < threads; i++) {
+		cmark_pdf_renderer_free(workers[i].renderer);
+	}
+	free(workers);
+	return 1;
+}
@@ -0,0 +1,23 @@
+#ifndef CMARK_PDF_SERVE_H
+#define CMARK_PDF_SERVE_H
+
+#include "pdf.h"
+
+// Listen on a Unix domain socket at path and render one document per
+// connection, on threads threads, each with its own renderer.
+//
+// A request is a header line, "LENGTH [FLAG...]\n", followed by
+// LENGTH bytes of Markdown.  The flags (smart, hardbreaks, sourcepos,
+// validate-utf8, optimal-breaks) are added to options.  The response
+// is "OK LENGTH\n" followed by LENGTH bytes of PDF, or "ERROR
+// message\n".  The connection is closed after the response, or once
+// the client has sent or taken nothing for 30 seconds.
+//
+// A socket already at path is replaced only if no server answers on
+// it; anything else at path is left alone.
+//
+// Only returns if the socket can't be set up, with 1.
+int serve(const char *path, int options, const cmark_pdf_config *config,
+	  int threads);
+
+#endif
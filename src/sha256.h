@@ -0,0 +1,28 @@
+#ifndef CMARK_PDF_SHA256_H
+#define CMARK_PDF_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4), for keys that must not collide: two images or
+// two inputs with the same digest are taken to be the same.
+
+#define SHA256_SIZE 32
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t len;  // bytes hashed so far
+	unsigned char block[64];
+};
+
+void sha256_init(struct sha256 *ctx);
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+
+// Write the digest of everything passed to sha256_update.
+void sha256_final(struct sha256 *ctx, unsigned char digest[SHA256_SIZE]);
+
+// The digest of len bytes at data.
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_SIZE]);
+
+#endif
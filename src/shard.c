@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <cmark.h>
+#include "shard.h"
+#include "merge.h"
+
+struct shard {
+	cmark_node * root;
+	unsigned char * pdf;
+	size_t len;
+	int ok;
+};
+
+struct shards {
+	struct shard * parts;
+	size_t count;
+	size_t size;
+	size_t next;  // next part to claim
+};
+
+struct shard_worker {
+	struct shards * shards;
+	cmark_pdf_renderer * renderer;
+	pthread_t thread;
+};
+
+static void *
+run_worker(void *arg)
+{
+	struct shard_worker * worker = (struct shard_worker*)arg;
+	struct shards * shards = worker->shards;
+	struct shard * part;
+	int marked = 1;
+	size_t i;
+
+	// each part subsets the characters of them all, so that the
+	// merged PDF has one subset of each font
+	for (i = 0; i < shards->count && marked; i++) {
+		marked = cmark_pdf_renderer_mark_text(worker->renderer,
+						      shards->parts[i].root);
+	}
+	while ((i = __atomic_fetch_add(&shards->next, 1,
+				       __ATOMIC_RELAXED)) < shards->count) {
+		part = &shards->parts[i];
+		part->ok = marked &&
+			cmark_pdf_render_to_buffer(worker->renderer,
+						   part->root,
+						   &part->pdf, &part->len);
+	}
+	return NULL;
+}
+
+static int
+add_part(struct shards *shards)
+{
+	struct shard * parts;
+	struct shard * part;
+	size_t size;
+
+	if (shards->count == shards->size) {
+		size = shards->size ? shards->size * 2 : 16;
+		parts = (struct shard*)realloc(shards->parts,
+					       size * sizeof(*parts));
+		if (parts == NULL) {
+			return 0;
+		}
+		shards->parts = parts;
+		shards->size = size;
+	}
+	part = &shards->parts[shards->count];
+	memset(part, 0, sizeof(*part));
+	part->root = cmark_node_new(CMARK_NODE_DOCUMENT);
+	if (part->root == NULL) {
+		return 0;
+	}
+	shards->count++;
+	return 1;
+}
+
+// Move the children of document into parts that each start at a
+// level-1 heading.  There is always at least one part.
+static int
+split(cmark_node *document, struct shards *shards)
+{
+	cmark_node * cur;
+	cmark_node * next;
+	cmark_node * part;
+
+	if (!add_part(shards)) {
+		return 0;
+	}
+	for (cur = cmark_node_first_child(document); cur; cur = next) {
+		next = cmark_node_next(cur);
+		part = shards->parts[shards->count - 1].root;
+		if (cmark_node_get_type(cur) == CMARK_NODE_HEADER &&
+		    cmark_node_get_header_level(cur) == 1 &&
+		    cmark_node_first_child(part) != NULL) {
+			if (!add_part(shards)) {
+				return 0;
+			}
+			part = shards->parts[shards->count - 1].root;
+		}
+		cmark_node_append_child(part, cur);
+	}
+	return 1;
+}
+
+// Put the children back into document and free the parts.
+static void
+unsplit(cmark_node *document, struct shards *shards)
+{
+	cmark_node * cur;
+	size_t i;
+
+	for (i = 0; i < shards->count; i++) {
+		while ((cur = cmark_node_first_child(shards->parts[i].root))) {
+			cmark_node_append_child(document, cur);
+		}
+		cmark_node_free(shards->parts[i].root);
+		free(shards->parts[i].pdf);
+	}
+	free(shards->parts);
+}
+
+int render_sharded(cmark_node *document, int options,
+		   const cmark_pdf_config *config, int threads,
+		   cmark_pdf_write_func write, void *userdata)
+{
+	struct shards shards = { NULL, 0, 0, 0 };
+	struct shard_worker * workers = NULL;
+	cmark_pdf_config part_config;
+	const unsigned char ** pdfs = NULL;
+	size_t * lens = NULL;
+	int started = 0;
+	int ok = 0;
+	int i;
+	size_t j;
+
+	if (!split(document, &shards)) {
+		goto done;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if ((size_t)threads > shards.count) {
+		threads = shards.count;
+	}
+	// the parts are the unit of parallelism, and at a given level
+	// each is deflated as soon as it is rendered, sharing the
+	// threads for that with the other workers, so that no more than
+	// one part per worker is held before it is deflated
+	part_config = *config;
+	part_config.layout_threads = 0;
+	part_config.compression_threads = config->compression_threads /
+		threads;
+
+	workers = (struct shard_worker*)calloc(threads, sizeof(*workers));
+	if (workers == NULL) {
+		goto done;
+	}
+	for (i = 0; i < threads; i++) {
+		workers[i].shards = &shards;
+		workers[i].renderer = cmark_pdf_renderer_new(options,
+							     &part_config);
+		if (workers[i].renderer == NULL) {
+			break;
+		}
+	}
+	threads = i;
+	if (threads == 0) {
+		goto done;
+	}
+
+	// the calling thread is the first worker
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	run_worker(&workers[0]);
+	for (i = 1; i <= started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	pdfs = (const unsigned char**)malloc(shards.count * sizeof(*pdfs));
+	lens = (size_t*)malloc(shards.count * sizeof(*lens));
+	if (pdfs == NULL || lens == NULL) {
+		goto done;
+	}
+	ok = 1;
+	for (j = 0; j < shards.count; j++) {
+		if (!shards.parts[j].ok) {
+			fprintf(stderr, "Could not render part %lu\n",
+				(unsigned long)j + 1);
+			ok = 0;
+		}
+		pdfs[j] = shards.parts[j].pdf;
+		lens[j] = shards.parts[j].len;
+	}
+	if (ok) {
+		// one part needs no merging, and the parts are deflated
+		// already
+		ok = shards.count == 1 ?
+			write(pdfs[0], lens[0], userdata) :
+			merge_pdfs(pdfs, lens, shards.count, 0, 1, write,
+				   userdata);
+	}
+
+done:
+	if (workers) {
+		for (i = 0; i < threads; i++) {
+			cmark_pdf_renderer_free(workers[i].renderer);
+		}
+	}
+	free(workers);
+	free(pdfs);
+	free(lens);
+	unsplit(document, &shards);
+	return ok;
+}
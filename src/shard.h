@@ -0,0 +1,16 @@
+#ifndef CMARK_PDF_SHARD_H
+#define CMARK_PDF_SHARD_H
+
+#include "pdf.h"
+
+// Render document in parts, each starting at a level-1 heading, on up
+// to threads threads, each with its own renderer, and merge the parts
+// into one PDF passed to write.  Each part starts on a new page, and
+// no libharu document holds more than one part.  The children of
+// document are moved into the parts while they render and put back
+// afterwards.  Returns 1 on success, 0 on failure.
+int render_sharded(cmark_node *document, int options,
+		   const cmark_pdf_config *config, int threads,
+		   cmark_pdf_write_func write, void *userdata);
+
+#endif